@@ -0,0 +1,428 @@
+/****
+LFR Benchmark app.
+
+Measures how script execution scales with the number of worker threads.
+Needs no graphics (only LIBC and pthreads).
+Build with `-DLFR_COMPACT_VARIANTS` to compare with the compact variant encoding.
+****/
+
+#define _POSIX_C_SOURCE 200809L
+
+// LIBC
+#include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Threads
+#include <pthread.h>
+#include <stdatomic.h>
+
+// SIMD
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LFR_SIMD
+#endif
+
+// La femme rouge
+#define LFR_THREADS
+#include "lfr.h"
+
+#define NUM_INSTANCES 10000
+#define NUM_FRAMES 100
+#define STEPS_PER_FRAME 64
+#define NUM_TABLE_NODES (1 << 20)
+
+// Benchmarks
+void build_bench_graph(lfr_graph_t *);
+void bench_threads(unsigned max_threads, const lfr_vm_t *, const lfr_graph_t *, const lfr_program_t *);
+void bench_batched(const lfr_vm_t *, const lfr_graph_t *);
+void bench_direct_flow(const lfr_vm_t *, const lfr_graph_t *, const lfr_program_t *);
+void bench_simd(void);
+void bench_node_table(const lfr_vm_t *);
+
+// Utils
+double now_seconds(void);
+double checksum_world(const lfr_world_t *);
+
+
+/**
+Starting point for the benchmark application.
+
+Usage: `bench [max threads]` (defaults to the number of online cores).
+**/
+int main(int argc, char** argv) {
+	long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned max_threads = (argc > 1 ? (unsigned) atoi(argv[1]) : (unsigned) (num_cores > 0 ? num_cores : 1));
+	if (!max_threads) { max_threads = 1; }
+
+	lfr_vm_t vm = {0};
+	lfr_graph_t graph;
+	lfr_init_graph(&graph);
+	build_bench_graph(&graph);
+	lfr_program_t program = lfr_compile_graph(&vm, &graph);
+
+	printf("# Interpreted graph\n");
+	bench_threads(max_threads, &vm, &graph, NULL);
+	printf("# Compiled program (%u of %u ops folded)\n", program.num_folded, program.num_ops);
+	bench_threads(max_threads, &vm, &graph, &program);
+	printf("# Batched instructions (single thread)\n");
+	bench_batched(&vm, &graph);
+	printf("# Direct flow (single thread)\n");
+	bench_direct_flow(&vm, &graph, NULL);
+	bench_direct_flow(&vm, &graph, &program);
+	printf("# Math kernels\n");
+	bench_simd();
+	printf("# Node table access\n");
+	bench_node_table(&vm);
+
+	lfr_term_program(&program);
+	lfr_term_graph(&graph);
+	return 0;
+}
+
+
+/**
+Build a math heavy graph (without any printing) that runs for a few steps every tick.
+**/
+void build_bench_graph(lfr_graph_t *graph) {
+	lfr_node_id_t tick = lfr_add_node(lfr_tick, graph);
+	lfr_node_id_t rnd = lfr_add_node(lfr_randomize_number, graph);
+	lfr_link_nodes(tick, rnd, graph);
+
+	// Chain of math nodes, each using the result of the previous one
+	lfr_node_id_t prev = rnd;
+	const lfr_instruction_e chain[] = { lfr_mul, lfr_add, lfr_sub, lfr_mul, lfr_add, lfr_sub, lfr_mul, lfr_add };
+	for (unsigned i = 0; i < sizeof(chain) / sizeof(chain[0]); i++) {
+		lfr_node_id_t node = lfr_add_node(chain[i], graph);
+		lfr_link_data(prev, 0, node, 0, graph);
+		lfr_set_fixed_input_value(node, 1, lfr_float(0.5f + (float) i), &graph->nodes);
+		lfr_link_nodes(prev, node, graph);
+		prev = node;
+	}
+
+	// Repeat the chain (sometimes)
+	lfr_node_id_t check = lfr_add_node(lfr_if_between, graph);
+	lfr_link_data(rnd, 0, check, 0, graph);
+	lfr_set_fixed_input_value(check, 1, lfr_float(0.f), &graph->nodes);
+	lfr_set_fixed_input_value(check, 2, lfr_float(0.5f), &graph->nodes);
+	lfr_link_nodes(prev, check, graph);
+	lfr_node_id_t repeat = lfr_add_node(lfr_repeat, graph);
+	lfr_set_fixed_input_value(repeat, 0, lfr_int(3), &graph->nodes);
+	lfr_link_nodes(check, repeat, graph);
+	lfr_node_id_t again = lfr_add_node(lfr_distance, graph);
+	lfr_set_fixed_input_value(again, 1, lfr_vec2_xy(3.f, 4.f), &graph->nodes);
+	lfr_link_nodes(repeat, again, graph);
+}
+
+
+/**
+Run the same world with 1 to max threads, printing time and speedup.
+
+The checksum of all instance outputs must be the same for all thread counts
+(states progress the same no matter which thread runs them).
+**/
+void bench_threads(unsigned max_threads, const lfr_vm_t *vm, const lfr_graph_t *graph, const lfr_program_t *program) {
+	double base_time = 0;
+	printf("threads\tseconds\tspeedup\tsteps\tchecksum\n");
+	for (unsigned num_threads = 1; num_threads <= max_threads; num_threads++) {
+		// Fresh world (seeded the same way every time)
+		lfr_world_t world;
+		lfr_init_world(vm, graph, program, &world);
+		for (unsigned i = 0; i < NUM_INSTANCES; i++) {
+			unsigned instance = lfr_add_world_instance(NULL, &world);
+			lfr_get_world_instance_state(instance, &world)->random_state = instance + 1;
+		}
+		lfr_worker_pool_t pool;
+		lfr_init_worker_pool(num_threads, &pool);
+
+		// Run frames
+		unsigned num_steps = 0;
+		double start = now_seconds();
+		for (unsigned frame = 0; frame < NUM_FRAMES; frame++) {
+			lfr_forward_world_time(1.f / 60.f, &world);
+			lfr_broadcast_world_instruction(lfr_tick, &world);
+			num_steps += lfr_step_world_in_pool(STEPS_PER_FRAME, &world, &pool);
+		}
+		double seconds = now_seconds() - start;
+		if (num_threads == 1) { base_time = seconds; }
+
+		printf("%u\t%.3f\t%.2f\t%u\t%f\n",
+			num_threads, seconds, base_time / seconds, num_steps, checksum_world(&world));
+
+		lfr_term_worker_pool(&pool);
+		lfr_term_world(&world);
+	}
+}
+
+
+/**
+Run the same world one instance at a time and batched, printing time and speedup (below one when batching does not pay off).
+
+The checksums must match (batching does not change how instances progress).
+**/
+void bench_batched(const lfr_vm_t *vm, const lfr_graph_t *graph) {
+	double base_time = 0;
+	printf("mode\tseconds\tspeedup\tsteps\tchecksum\n");
+	for (int batched = 0; batched < 2; batched++) {
+		lfr_world_t world;
+		lfr_init_world(vm, graph, NULL, &world);
+		for (unsigned i = 0; i < NUM_INSTANCES; i++) {
+			unsigned instance = lfr_add_world_instance(NULL, &world);
+			lfr_get_world_instance_state(instance, &world)->random_state = instance + 1;
+		}
+
+		unsigned num_steps = 0;
+		double start = now_seconds();
+		for (unsigned frame = 0; frame < NUM_FRAMES; frame++) {
+			lfr_forward_world_time(1.f / 60.f, &world);
+			lfr_broadcast_world_instruction(lfr_tick, &world);
+			if (batched) {
+				num_steps += lfr_step_world_batched(STEPS_PER_FRAME, &world);
+			} else {
+				num_steps += lfr_step_world(STEPS_PER_FRAME, &world);
+			}
+		}
+		double seconds = now_seconds() - start;
+		if (!batched) { base_time = seconds; }
+
+		printf("%s\t%.3f\t%.2f\t%u\t%f\n", (batched ? "batched" : "single"),
+			seconds, base_time / seconds, num_steps, checksum_world(&world));
+		lfr_term_world(&world);
+	}
+}
+
+
+/**
+Run the same world with flow targets queued and processed right away, printing time and speedup.
+
+The checksums must match (only the number of steps changes, as linear chains take a single step).
+**/
+void bench_direct_flow(const lfr_vm_t *vm, const lfr_graph_t *graph, const lfr_program_t *program) {
+	double base_time = 0;
+	printf("mode\tseconds\tspeedup\tsteps\tchecksum\n");
+	for (int direct = 0; direct < 2; direct++) {
+		lfr_world_t world;
+		lfr_init_world(vm, graph, program, &world);
+		for (unsigned i = 0; i < NUM_INSTANCES; i++) {
+			unsigned instance = lfr_add_world_instance(NULL, &world);
+			lfr_graph_state_t *state = lfr_get_world_instance_state(instance, &world);
+			state->random_state = instance + 1;
+			lfr_set_direct_flow(direct ? 16 : 0, state);
+		}
+
+		unsigned num_steps = 0;
+		double start = now_seconds();
+		for (unsigned frame = 0; frame < NUM_FRAMES; frame++) {
+			lfr_forward_world_time(1.f / 60.f, &world);
+			lfr_broadcast_world_instruction(lfr_tick, &world);
+			num_steps += lfr_step_world(STEPS_PER_FRAME, &world);
+		}
+		double seconds = now_seconds() - start;
+		if (!direct) { base_time = seconds; }
+
+		printf("%s%s\t%.3f\t%.2f\t%u\t%f\n", (direct ? "direct" : "queued"), (program ? " (compiled)" : ""),
+			seconds, base_time / seconds, num_steps, checksum_world(&world));
+		lfr_term_world(&world);
+	}
+}
+
+
+/**
+Run batched math instructions over large columns at every SIMD level up to the best one supported.
+
+Results must be bit for bit identical to the scalar ones.
+**/
+void bench_simd(void) {
+	enum { num_values = 1 << 16, num_rounds = 200 };
+	static const char *level_names[lfr_no_simd_levels] = { "scalar", "sse2", "avx2" };
+	const lfr_instruction_e insts[] = { lfr_add, lfr_sub, lfr_mul, lfr_distance };
+	const lfr_simd_e best = lfr_get_simd_level();
+
+	// Inputs (two columns of floats and two of vec2)
+	lfr_variant_t *columns = calloc(4 * num_values, sizeof(lfr_variant_t));
+	lfr_variant_t *output = calloc(num_values, sizeof(lfr_variant_t));
+	lfr_variant_t *expected = calloc(num_values, sizeof(lfr_variant_t));
+	lfr_process_env_i *env = calloc(num_values, sizeof(lfr_process_env_i));
+	lfr_result_e *result = calloc(num_values, sizeof(lfr_result_e));
+	unsigned seed = 1;  // Same inputs every run
+	for (unsigned i = 0; i < num_values; i++) {
+		columns[0 * num_values + i] = lfr_float((float) rand_r(&seed) / RAND_MAX * 100.f - 50.f);
+		columns[1 * num_values + i] = lfr_float((float) rand_r(&seed) / RAND_MAX * 100.f - 50.f);
+		columns[2 * num_values + i] = lfr_vec2_xy((float) rand_r(&seed) / RAND_MAX, (float) rand_r(&seed) / RAND_MAX);
+		columns[3 * num_values + i] = lfr_vec2_xy((float) rand_r(&seed) / RAND_MAX, (float) rand_r(&seed) / RAND_MAX);
+	}
+
+	printf("inst\tlevel\tseconds\tspeedup\tsame\n");
+	for (unsigned n = 0; n < sizeof(insts) / sizeof(insts[0]); n++) {
+		const lfr_instruction_def_t *def = lfr_get_core_instruction(insts[n], NULL);
+		const unsigned first_column = (insts[n] == lfr_distance ? 2 : 0);
+		double base_time = 0;
+		for (lfr_simd_e level = lfr_simd_none; level <= best; level++) {
+			lfr_limit_simd_level(level);
+			lfr_batch_t batch = { num_values, {0}, {output}, env, result };
+			for (int i = 0; i < 2; i++) {
+				batch.input[i] = columns + (first_column + i) * num_values;
+			}
+
+			double start = now_seconds();
+			for (unsigned round = 0; round < num_rounds; round++) { def->batch_func(&batch); }
+			double seconds = now_seconds() - start;
+			if (level == lfr_simd_none) {
+				base_time = seconds;
+				memcpy(expected, output, num_values * sizeof(lfr_variant_t));
+			}
+
+			// Compare bits (not values)
+			bool same = true;
+			for (unsigned i = 0; i < num_values; i++) {
+				same = same && lfr_get_variant_type(expected[i]) == lfr_get_variant_type(output[i])
+					&& !memcmp(&expected[i].float_value, &output[i].float_value, sizeof(float));
+			}
+			printf("%s\t%s\t%.3f\t%.2f\t%s\n", def->name, level_names[level],
+				seconds, base_time / seconds, (same ? "yes" : "NO"));
+		}
+	}
+	lfr_limit_simd_level(best);
+
+	free(result);
+	free(env);
+	free(expected);
+	free(output);
+	free(columns);
+}
+
+
+/**
+Walk a chain of nodes spread out randomly over the node table, for a small table (that fits in cache)
+and a big one (that does not).
+
+Every node of the big table is a cache miss, so the difference in time per node between the two
+is how much waiting for memory it costs to read what a step needs from the node table.
+"gather" only reads the inputs of each node (like a step does), "step" runs the nodes for real.
+Best of a few runs (to keep noise down).
+**/
+void bench_node_table(const lfr_vm_t *vm) {
+	printf("nodes\tgather ns/node\tstep ns/node\tchecksum\n");
+	const unsigned table_sizes[] = {1 << 10, NUM_TABLE_NODES};
+	for (int t = 0; t < 2; t++) {
+		const unsigned num_nodes = table_sizes[t];
+		lfr_graph_t graph;
+		lfr_init_graph(&graph);
+		lfr_reserve_node_table_rows(num_nodes, &graph.nodes);
+		for (unsigned i = 0; i < num_nodes; i++) {
+			lfr_node_id_t node = lfr_add_node(lfr_add, &graph);
+			lfr_set_fixed_input_value(node, 1, lfr_float(1.f), &graph.nodes);
+		}
+
+		// Chain rows in random order, each node adding one to the previous
+		// (scheduled one by one, as flow links would add lookups outside of the node table)
+		lfr_node_id_t *chain = calloc(num_nodes, sizeof(lfr_node_id_t));
+		for (unsigned i = 0; i < num_nodes; i++) { chain[i] = graph.nodes.dense_id[i]; }
+		unsigned seed = 1;
+		for (unsigned i = num_nodes - 1; i > 0; i--) {
+			unsigned j = (unsigned) rand_r(&seed) % (i + 1);
+			lfr_node_id_t tmp = chain[i];
+			chain[i] = chain[j];
+			chain[j] = tmp;
+		}
+		for (unsigned i = 1; i < num_nodes; i++) {
+			lfr_link_data(chain[i - 1], 0, chain[i], 0, &graph);
+		}
+
+		// Gather inputs (before anything has run, so only the node table is read)
+		const unsigned num_inputs = lfr_count_instruction_inputs(lfr_add, vm);
+		lfr_graph_state_t state = {0};
+		float sum = 0;
+		double gather_seconds = DBL_MAX;
+		for (int round = 0; round < 3; round++) {
+			double start = now_seconds();
+			for (unsigned i = 0; i < num_nodes; i++) {
+				for (unsigned slot = 0; slot < num_inputs; slot++) {
+					sum += lfr_to_float(lfr_get_input_value(chain[i], slot, vm, &graph, &state));
+				}
+			}
+			gather_seconds = fmin(gather_seconds, now_seconds() - start);
+		}
+
+		// Run chain a few times (not counting the first time, when state rows get allocated)
+		double step_seconds = DBL_MAX;
+		for (int round = 0; round < 4; round++) {
+			double start = now_seconds();
+			for (unsigned i = 0; i < num_nodes; i++) {
+				lfr_schedule_node(chain[i], &graph, &state);
+				lfr_step(vm, &graph, &state);
+			}
+			if (round) { step_seconds = fmin(step_seconds, now_seconds() - start); }
+		}
+		sum += lfr_to_float(lfr_get_output_value(chain[num_nodes - 1], 0, vm, &graph, &state));
+
+		printf("%u\t%.1f\t%.1f\t%.0f\n", num_nodes,
+			gather_seconds * 1e9 / num_nodes, step_seconds * 1e9 / num_nodes, sum);
+
+		free(chain);
+		lfr_term_graph_state(&state);
+		lfr_term_graph(&graph);
+	}
+}
+
+
+/**
+Current (monotonic) time in seconds.
+**/
+double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+
+/**
+Sum of the first output of every node (that has one) in every instance.
+**/
+double checksum_world(const lfr_world_t *world) {
+	double sum = 0;
+	for (unsigned i = 0; i < world->num_instances; i++) {
+		const lfr_graph_state_t *state = &world->instances[i].state;
+		for (unsigned row = 0; row < world->graph->nodes.num_rows; row++) {
+			if (!world->graph->nodes.node[row].num_outputs) { continue; }
+			lfr_node_id_t id = world->graph->nodes.dense_id[row];
+			sum += lfr_to_float(lfr_get_output_value(id, 0, world->vm, world->graph, state));
+		}
+	}
+	return sum;
+}
+
+#define LFR_IMPLEMENTATION
+#include "lfr.h"
+
+/********************************************************************************
+MIT License
+===========
+
+Copyright (c) 2021 Jakob Eklund
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************************/
@@ -81,6 +81,7 @@ int main( int argc, char** argv) {
 		lfr_save_graph_to_file_path(&graph, &vm, argv[1]);
 	}
 
+	lfr_term_graph_state(&state);
 	lfr_term_graph(&graph);
 	return 0; 
 }
@@ -161,6 +162,7 @@ void run_gui(const lfr_vm_t *vm, lfr_graph_t* graph, lfr_graph_state_t *state) {
 
 	// Terminate application
 	quit:
+	lfr_term_editor(&app);
 	nk_glfw3_shutdown(&glfw);
 	term_gl_app(window);
 }
@@ -159,7 +159,7 @@ lfr_result_e set_actor_position_proc( lfr_variant_t input[], lfr_variant_t outpu
 	actor_index %= num_actors_in_world;
 
 	// Get new position
-	lfr_vec2_t in_pos = input[1].vec2_value;
+	lfr_vec2_t in_pos = lfr_to_vec2(input[1]);
 
 	// Set new position
 	pop->actor_positions[actor_index] = (vec2_t) { in_pos.x, in_pos.y };
@@ -185,6 +185,36 @@ lfr_result_e get_actor_position_proc( lfr_variant_t input[], lfr_variant_t outpu
 }
 
 
+/**
+Script instruction: Set position of the given actors (batched).
+**/
+void set_actor_position_batch(lfr_batch_t *batch) {
+	for (unsigned k = 0; k < batch->size; k++) {
+		assert(batch->env[k].custom_data);
+		population_t *pop = batch->env[k].custom_data;
+		int actor_index = batch->input[0][k].int_value % num_actors_in_world;
+		lfr_vec2_t in_pos = lfr_to_vec2(batch->input[1][k]);
+		pop->actor_positions[actor_index] = (vec2_t) { in_pos.x, in_pos.y };
+		batch->result[k] = lfr_continue;
+	}
+}
+
+
+/**
+Script instruction: Get position of the given actors (batched).
+**/
+void get_actor_position_batch(lfr_batch_t *batch) {
+	for (unsigned k = 0; k < batch->size; k++) {
+		assert(batch->env[k].custom_data);
+		const population_t *pop = batch->env[k].custom_data;
+		int actor_index = batch->input[0][k].int_value % num_actors_in_world;
+		vec2_t pos = pop->actor_positions[actor_index];
+		batch->output[0][k] = lfr_vec2_xy(pos.x, pos.y);
+		batch->result[k] = lfr_continue;
+	}
+}
+
+
 /**
 Script instruction: Get the current cursor position in world space.
 **/
@@ -227,7 +257,7 @@ lfr_result_e on_actor_event_proc( lfr_variant_t input[], lfr_variant_t output[],
 
 	// Optionally only trigger once
 	bool once = lfr_to_bool(input[0]);
-	if (once && lfr_node_state_table_contains(env->node_id, &env->graph_state->nodes)) {
+	if (once && lfr_node_state_table_contains(env->node_id, &env->graph->nodes, &env->graph_state->nodes)) {
 		return lfr_halt;
 	};
 
@@ -246,33 +276,43 @@ lfr_result_e on_actor_event_proc( lfr_variant_t input[], lfr_variant_t output[],
 lfr_instruction_def_t game_instructions[gi_no_instructions] = {
 	{"set_actor_position", set_actor_position_proc,
 		{
-			{"ACTOR", {lfr_int_type, .int_value = 0 }},
-			{"POS", (lfr_variant_t) { lfr_vec2_type, .vec2_value = { 0,0}}},
+			{"ACTOR", LFR_INT(0)},
+			{"POS", LFR_ORIGO},
 		},
 		{},
+		set_actor_position_batch,
+		.flags = lfr_writes_host,
 	},
 	{"get_actor_position", get_actor_position_proc,
-		{{"ACTOR", {lfr_int_type, .int_value = 0 }}},
-		{{"POS", (lfr_variant_t) { lfr_vec2_type, .vec2_value = { 0,0}}},},
+		{{"ACTOR", LFR_INT(0)}},
+		{{"POS", LFR_ORIGO},},
+		get_actor_position_batch,
+		.flags = lfr_reads_host,
 	},
 	{"get_cursor_position", get_cursor_position_proc,
 		{},
-		{{"POS", (lfr_variant_t) { lfr_vec2_type, .vec2_value = { 0,0}}},},
+		{{"POS", LFR_ORIGO},},
+		.flags = lfr_reads_host,
 	},
 	{"set_actor_scale", set_actor_scale_proc,
 		{
-			{"ACTOR", {lfr_int_type, .int_value = 0 }},
-			{"SCALE", (lfr_variant_t) { lfr_float_type, .float_value = 0}},
+			{"ACTOR", LFR_INT(0)},
+			{"SCALE", LFR_FLOAT(0)},
 		},
 		{},
+		.flags = lfr_writes_host,
 	},
 	{"on_enter", on_actor_event_proc,
 		{{"ONCE", LFR_BOOL(false)}, {"FILTER", LFR_INT(-1)}},
 		{{"ACTOR", LFR_INT(0)}},
+		.every_event = true, // One event per actor
+		.flags = lfr_yields, // Filtered events stop the flow
 	},
 	{"on_exit", on_actor_event_proc,
 		{{"ONCE", LFR_BOOL(false)}, {"FILTER", LFR_INT(-1)}},
 		{{"ACTOR", LFR_INT(0)}},
+		.every_event = true, // One event per actor
+		.flags = lfr_yields, // Filtered events stop the flow
 	},
 };
 
@@ -330,6 +370,7 @@ int main( int argc, char** argv) {
 	lfr_graph_t graph = {0};
 	lfr_init_graph(&graph);
 	lfr_graph_state_t graph_state = {0};
+	lfr_set_node_coalescing(&vm, &graph_state); // Ticks pile up while stepping slowly
 	lfr_editor_t editor = {0};
 	lfr_init_editor(nk_rect(0,0, 1920, 1080/2), ctx, &editor);
 
@@ -340,8 +381,8 @@ int main( int argc, char** argv) {
 	} else {
 		// Set up LFR example
 		// (keep things simmple by skipping load from file)
-		lfr_node_id_t n1 = lfr_add_custom_node(gi_get_actor_position, &graph);
-		lfr_node_id_t n2 = lfr_add_custom_node(gi_set_actor_position, &graph);
+		lfr_node_id_t n1 = lfr_add_custom_node(gi_get_actor_position, &vm, &graph);
+		lfr_node_id_t n2 = lfr_add_custom_node(gi_set_actor_position, &vm, &graph);
 		lfr_link_nodes(n1, n2, &graph);
 		lfr_link_data(n1, 0, n2, 1, &graph);
 	}
@@ -514,6 +555,8 @@ int main( int argc, char** argv) {
 
 	// Terminate application
 	quit:
+	lfr_term_editor(&editor);
+	lfr_term_graph_state(&graph_state);
 	lfr_term_graph(&graph);
 	nk_glfw3_shutdown(&glfw);
 	delete_mesh(&triangle);
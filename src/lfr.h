@@ -9,6 +9,9 @@ La Femme Rough - An minimal graph based scripting system for games.
 typedef struct lfr_vec2_ { float x,y; } lfr_vec2_t;
 #define LFR_VEC2_ORIGO ((lfr_vec2_t) { 0, 0})
 
+// Time in microseconds
+typedef unsigned long long lfr_time_t;
+
 typedef enum lfr_variant_type_ {
 	lfr_nil_type,
 	lfr_bool_type,
@@ -18,6 +21,7 @@ typedef enum lfr_variant_type_ {
 	lfr_no_core_types
 } lfr_variant_type_e;
 
+#ifndef LFR_COMPACT_VARIANTS
 typedef struct lfr_variant_ {
 	lfr_variant_type_e type;
 	union {
@@ -28,19 +32,68 @@ typedef struct lfr_variant_ {
 	};
 } lfr_variant_t;
 
+lfr_variant_type_e lfr_get_variant_type(lfr_variant_t v) { return v.type; }
 lfr_variant_t lfr_bool(bool v) { return (lfr_variant_t) {lfr_bool_type, .bool_value = v}; }
 lfr_variant_t lfr_int(int v) { return (lfr_variant_t) {lfr_int_type, .int_value = v}; }
 lfr_variant_t lfr_float(float v) { return (lfr_variant_t) {lfr_float_type, .float_value = v}; }
 lfr_variant_t lfr_vec2(lfr_vec2_t v) { return (lfr_variant_t) { lfr_vec2_type, .vec2_value = v}; }
-lfr_variant_t lfr_vec2_xy(float x, float y) { return lfr_vec2((lfr_vec2_t){x,y}); }
 
+#define LFR_NIL (lfr_variant_t){lfr_nil_type}
 #define LFR_BOOL(v) (lfr_variant_t){lfr_bool_type, .bool_value = v }
 #define LFR_INT(v) (lfr_variant_t){lfr_int_type, .int_value = v }
 #define LFR_FLOAT(v) (lfr_variant_t){lfr_float_type, .float_value = v }
+#define LFR_ORIGO (lfr_variant_t){lfr_vec2_type, .vec2_value = {0, 0} }
+
+#else
+/*
+Compact (8 byte) variant, enabled by defining `LFR_COMPACT_VARIANTS`.
+
+Scalars are boxed: `box` holds the type and the value is stored inline in the first word.
+Any other `box` is a vec2, with `x` in the first word and the inverted bits of `y` in `box`.
+Inverted boxes are (negative) NaN bit patterns, so a NaN `y` is stored as a canonical NaN
+(leaving plenty of boxes for more types). All zero bits is nil, just like the regular variant.
+
+There is no `type` or `vec2_value` field, use `lfr_get_variant_type()` and `lfr_to_vec2()`.
+*/
+typedef struct lfr_variant_ {
+	union {
+		int bool_value; // Zero or one
+		int int_value;
+		float float_value;
+		unsigned bits;
+	};
+	unsigned box;
+} lfr_variant_t;
+
+/* Reinterpret float bits as unsigned (and back). */
+unsigned lfr_float_bits_(float v) { return ((union { float f; unsigned u; }) { .f = v }).u; }
+float lfr_bits_float_(unsigned v) { return ((union { unsigned u; float f; }) { .u = v }).f; }
+
+lfr_variant_type_e lfr_get_variant_type(lfr_variant_t v) {
+	// Scalar types are all ordered before vec2
+	return (v.box < lfr_vec2_type ? (lfr_variant_type_e) v.box : lfr_vec2_type);
+}
+lfr_variant_t lfr_bool(bool v) { return (lfr_variant_t) {.bool_value = v, .box = lfr_bool_type}; }
+lfr_variant_t lfr_int(int v) { return (lfr_variant_t) {.int_value = v, .box = lfr_int_type}; }
+lfr_variant_t lfr_float(float v) { return (lfr_variant_t) {.float_value = v, .box = lfr_float_type}; }
+lfr_variant_t lfr_vec2(lfr_vec2_t v) {
+	unsigned y = (v.y == v.y ? lfr_float_bits_(v.y) : 0x7fc00000u); // Canonical NaN
+	return (lfr_variant_t) {.float_value = v.x, .box = ~y};
+}
+
+#define LFR_NIL (lfr_variant_t){.bits = 0, .box = lfr_nil_type}
+#define LFR_BOOL(v) (lfr_variant_t){.bool_value = !!(v), .box = lfr_bool_type}
+#define LFR_INT(v) (lfr_variant_t){.int_value = v, .box = lfr_int_type}
+#define LFR_FLOAT(v) (lfr_variant_t){.float_value = v, .box = lfr_float_type}
+#define LFR_ORIGO (lfr_variant_t){.bits = 0, .box = ~0u}
+
+#endif
+lfr_variant_t lfr_vec2_xy(float x, float y) { return lfr_vec2((lfr_vec2_t){x,y}); }
 
 float lfr_to_float(lfr_variant_t);
 int lfr_to_int(lfr_variant_t);
 bool lfr_to_bool(lfr_variant_t);
+lfr_vec2_t lfr_to_vec2(lfr_variant_t);
 
 //// LFR Instructions ////
 
@@ -70,6 +123,8 @@ typedef enum lfr_instruction_ {
 	lfr_if_between,
 	lfr_repeat,
 	lfr_delay,
+	lfr_await_signal,
+	lfr_send_signal,
 	lfr_no_core_instructions // Not an instruction :P
 } lfr_instruction_e;
 
@@ -82,39 +137,118 @@ typedef struct lfr_vm_ lfr_vm_t;
 
 //// LFR Node ////
 
-typedef struct lfr_node_id_ { unsigned id; } lfr_node_id_t;
-
-enum {lfr_signature_size = 8};
+/*
+Node id handle.
+
+The generation is odd while the node is in its table and changes when it is removed,
+so handles to removed nodes are rejected even if the id number is ever used again.
+An id with `id` zero is the "null" id (never in any table).
+*/
+typedef struct lfr_node_id_ { unsigned id, gen; } lfr_node_id_t;
+
+/* Reference to a data slot of a node. */
+typedef struct lfr_slot_ref_ {
+	lfr_node_id_t node;
+	unsigned slot;
+} lfr_slot_ref_t;
+
+/* Most input (or output) slots an instruction can have. */
+enum {lfr_signature_size = 32};
+
+/*
+Scheduling priority of a node.
+
+Each priority is a lane of its own when scheduled, higher lanes are emptied before lower
+(and deferred nodes come after all of them).
+*/
+typedef enum lfr_priority_ {
+	lfr_critical_priority,
+	lfr_high_priority,
+	lfr_normal_priority,
+	lfr_low_priority,
+	lfr_no_priorities // Not a priority :P
+} lfr_priority_e;
+
+const char* lfr_get_priority_name(lfr_priority_e);
+
+/*
+Everything needed to run a node (the rest lives in separate columns of the node table).
+
+Slots are kept in the slot pool of the table, inputs first and then outputs,
+with only as many slots as the instruction of the node declares.
+The slot masks (one bit per input slot) tell which slots are linked and which have a fixed value,
+so only the slots that are actually in use have to be read.
+*/
 typedef struct lfr_node_ {
 	unsigned instruction;
-	struct {
-		lfr_node_id_t node;
-		unsigned int slot;
-		lfr_variant_t fixed_value;
-	} input_data[lfr_signature_size];
-	lfr_variant_t output_data[lfr_signature_size];
+	unsigned first_slot;
+	unsigned char num_inputs, num_outputs;
+	unsigned char priority; // Lane the node is scheduled in (see `lfr_priority_e`)
+	unsigned linked, fixed;
 } lfr_node_t;
 
-enum {lfr_node_table_max_rows = 16, lfr_node_table_id_range = 1024};
+/* Slot of a node (in the slot pool of the node table). */
+typedef struct lfr_slot_ {
+	lfr_variant_t value; // Fixed value (inputs) or default value (outputs)
+	lfr_slot_ref_t link; // Output slot linked from (inputs) or first input slot linked to (outputs)
+} lfr_slot_t;
+
+/*
+Nodes grouped by key (like instruction or node id number), in one run per key.
+
+Nodes are either removed by moving the last node of the run into the gap
+(then the owner keeps track of where in its run every node is),
+or cut out keeping the order of the run (which costs the length of the run).
+Every node carries a tag that is up to the owner (like the flow link it stands for).
+*/
+typedef struct lfr_node_groups_ {
+	lfr_node_id_t **nodes; // Run of each key
+	unsigned **tag; // Tag of each node in the run
+	unsigned *num_nodes, *max_nodes;
+	unsigned key_range;
+} lfr_node_groups_t;
+
 typedef struct lfr_node_table_ {
 	// Meta fields
-	unsigned sparse_id[lfr_node_table_id_range];
-	lfr_node_id_t dense_id[lfr_node_table_max_rows];
-	unsigned num_rows, next_id;
+	unsigned *sparse_id, *generation;
+	lfr_node_id_t *dense_id;
+	unsigned num_rows, max_rows, id_range, next_id;
+
+	// Data colums (split by use, so running nodes only touches the first one)
+	lfr_node_t *node;
+	lfr_vec2_t *position;
+
+	// Slot pool (a run of slots per row, compacted once too many of them belong to removed rows)
+	lfr_slot_t *slot;
+	lfr_slot_ref_t *next_reader; // Next input slot linked to the same output (reverse index)
+	unsigned num_slots, max_slots, num_unused_slots;
 
-	// Data colums
-	lfr_node_t node[lfr_node_table_max_rows];
-	lfr_vec2_t position[lfr_node_table_max_rows];
+	// Nodes by instruction (kept up to date on insert, remove and id change)
+	lfr_node_groups_t by_instruction;
+	unsigned *instruction_at; // Where each row is in the run of its instruction
+
+	// Bumped whenever rows move or data links are broken (graph states catch up when it changes)
+	unsigned revision;
 } lfr_node_table_t;
 
+// Node table memory
+void lfr_reserve_node_table_rows(unsigned num_rows, lfr_node_table_t *);
+void lfr_shrink_node_table(lfr_node_table_t *);
+void lfr_term_node_table(lfr_node_table_t *);
+
 // Node CRUD
-lfr_node_id_t lfr_insert_node_into_table(unsigned instruction, lfr_node_table_t*);
-void lfr_change_node_id_in_table(lfr_node_id_t old_id, lfr_node_id_t new_id, lfr_node_table_t  *table);
+lfr_node_id_t lfr_insert_node_into_table(unsigned instruction, const lfr_vm_t *, lfr_node_table_t*);
+lfr_node_id_t lfr_change_node_id_in_table(lfr_node_id_t old_id, unsigned new_id, lfr_node_table_t  *table);
+bool lfr_node_table_contains(lfr_node_id_t, const lfr_node_table_t *);
+unsigned lfr_get_nodes_with_instruction(unsigned instruction, const lfr_node_table_t *, const lfr_node_id_t **);
+lfr_node_id_t lfr_get_node_id(unsigned id, const lfr_node_table_t *);
 unsigned lfr_get_node_index(lfr_node_id_t, const lfr_node_table_t *);
 lfr_vec2_t lfr_get_node_position(lfr_node_id_t, const lfr_node_table_t *);
+lfr_priority_e lfr_get_node_priority(lfr_node_id_t, const lfr_node_table_t *);
 lfr_variant_t lfr_get_fixed_input_value(lfr_node_id_t, unsigned slot, const lfr_vm_t *, const lfr_node_table_t *);
 lfr_variant_t lfr_get_default_output_value(lfr_node_id_t, unsigned, const lfr_vm_t *, const lfr_node_table_t *);
 void lfr_set_node_position(lfr_node_id_t, lfr_vec2_t, lfr_node_table_t *);
+void lfr_set_node_priority(lfr_node_id_t, lfr_priority_e, lfr_node_table_t *);
 void lfr_set_fixed_input_value(lfr_node_id_t, unsigned slot, lfr_variant_t, lfr_node_table_t *);
 void lfr_set_default_output_value(lfr_node_id_t, unsigned slot, lfr_variant_t, lfr_node_table_t *);
 void lfr_remove_node_from_table(lfr_node_id_t, lfr_node_table_t *);
@@ -122,6 +256,7 @@ void lfr_remove_node_from_table(lfr_node_id_t, lfr_node_table_t *);
 // Node serialization
 int lfr_save_nodes_in_table_to_file(const lfr_node_table_t*, const lfr_vm_t *, FILE * restrict stream);
 int lfr_save_node_placements_in_table_to_file(const lfr_node_table_t*, const lfr_vm_t *, FILE * restrict stream);
+int lfr_save_node_priorities_in_table_to_file(const lfr_node_table_t*, FILE * restrict stream);
 int lfr_save_data_links_in_table_to_file(const lfr_node_table_t*, FILE * restrict stream);
 int lfr_save_fixed_values_in_table_to_file(const lfr_node_table_t*, FILE * restrict stream);
 
@@ -131,15 +266,17 @@ typedef struct lfr_flow_link_ {
 	lfr_node_id_t source_node, target_node;
 } lfr_flow_link_t;
 
-enum {lfr_graph_max_flow_links = 32};
 typedef struct lfr_graph_ {
 	// Nodes
 	lfr_node_table_t nodes;
 	lfr_vec2_t next_node_pos;
 
 	// Flow links
-	lfr_flow_link_t flow_links[lfr_graph_max_flow_links];
-	unsigned num_flow_links;
+	lfr_flow_link_t *flow_links;
+	unsigned num_flow_links, max_flow_links;
+
+	// Flow link adjacency by node id number, in the order linked (tagged with the number of the link)
+	lfr_node_groups_t flow_targets, flow_sources;
 } lfr_graph_t;
 
 void lfr_init_graph(lfr_graph_t *);
@@ -147,7 +284,7 @@ void lfr_term_graph(lfr_graph_t *);
 
 // Node CRUD (for graph)
 lfr_node_id_t lfr_add_node(lfr_instruction_e, lfr_graph_t *);
-lfr_node_id_t lfr_add_custom_node(unsigned bytecode, lfr_graph_t *);
+lfr_node_id_t lfr_add_custom_node(unsigned bytecode, const lfr_vm_t *, lfr_graph_t *);
 void lfr_remove_node(lfr_node_id_t, lfr_graph_t *);
 
 // Flow link CRUD
@@ -155,6 +292,8 @@ void lfr_link_nodes(lfr_node_id_t, lfr_node_id_t, lfr_graph_t*);
 bool lfr_has_link(lfr_node_id_t, lfr_node_id_t, const lfr_graph_t*);
 unsigned lfr_count_node_source_links(lfr_node_id_t, const lfr_graph_t*);
 unsigned lfr_count_node_target_links(lfr_node_id_t, const lfr_graph_t*);
+unsigned lfr_get_node_flow_targets(lfr_node_id_t, const lfr_graph_t*, const lfr_node_id_t **);
+unsigned lfr_get_node_flow_sources(lfr_node_id_t, const lfr_graph_t*, const lfr_node_id_t **);
 void lfr_unlink_nodes(lfr_node_id_t, lfr_node_id_t, lfr_graph_t*);
 void lfr_disconnect_node(lfr_node_id_t, lfr_graph_t *);
 
@@ -163,6 +302,12 @@ void lfr_link_data(lfr_node_id_t, unsigned, lfr_node_id_t, unsigned, lfr_graph_t
 void lfr_unlink_input_data(lfr_node_id_t, unsigned, lfr_graph_t*);
 void lfr_unlink_output_data(lfr_node_id_t, unsigned, lfr_graph_t*);
 
+// Data link queries (who reads this output? what is this input linked to?)
+lfr_slot_ref_t lfr_get_first_data_reader(lfr_node_id_t, unsigned, const lfr_graph_t*);
+lfr_slot_ref_t lfr_get_next_data_reader(lfr_slot_ref_t, const lfr_graph_t*);
+unsigned lfr_count_data_readers(lfr_node_id_t, unsigned, const lfr_graph_t*);
+lfr_slot_ref_t lfr_get_data_link(lfr_node_id_t, unsigned, const lfr_graph_t*);
+
 // Node signatures
 unsigned lfr_count_node_inputs(lfr_node_id_t, const lfr_vm_t *, lfr_graph_t *);
 unsigned lfr_count_node_outputs(lfr_node_id_t, const lfr_vm_t *, lfr_graph_t *);
@@ -186,27 +331,78 @@ typedef struct lfr_process_env_ {
 
 	// Processing
 	unsigned work;
+	lfr_time_t wake_time; // When to process again after returning `lfr_sleep` (see `clock`)
+	unsigned signal; // Signal to wait for when returning `lfr_await` (see `lfr_raise_signal()`)
 	lfr_graph_state_t *graph_state;
 
 	// Surroundings
 	const float time;
+	const lfr_time_t clock; // Same as time (in microseconds)
 	void *custom_data;
 } lfr_process_env_i;
 
 typedef enum lfr_result_ {
 	lfr_halt,
-	lfr_wait,
+	lfr_wait, // Process again as soon as nothing else is scheduled
+	lfr_sleep, // Process again once the clock reaches `wake_time` (costs nothing until then)
+	lfr_await, // Process again once `signal` is raised (costs nothing until then)
 	lfr_continue,
 	lfr_no_results // Not a result :P
 } lfr_result_e;
 
+/*
+Columns of input and output data for a batch of the same graph node in different graph states.
+
+The k:th value of each column (and the k:th env and result) belongs to the k:th state of the batch.
+There are only columns for the slots declared by the instruction.
+*/
+typedef struct lfr_batch_ {
+	unsigned size;
+	const lfr_variant_t *input[lfr_signature_size];
+	lfr_variant_t *output[lfr_signature_size];
+	lfr_process_env_i *env;
+	lfr_result_e *result;
+} lfr_batch_t;
+
+typedef struct lfr_slot_def_ {
+	const char* name;
+	lfr_variant_t data;
+} lfr_slot_def_t;
+
+/*
+What an instruction does besides turning input into output (see `flags` in instruction definitions).
+
+Analysis and optimizations rely on these, so only flag an instruction `lfr_pure` if it really is
+(no flags only means that none of the other things are done, not that the instruction may be optimized).
+Define `LFR_CHECK_INSTRUCTIONS` to check flags as instructions are processed (slow, for debugging).
+*/
+typedef enum lfr_instruction_flag_ {
+	lfr_pure = 1 << 0, // Outputs only depend on inputs and nothing else is read or changed (no other flags)
+	lfr_reads_host = 1 << 1, // Reads custom data (or anything else outside the graph)
+	lfr_writes_host = 1 << 2, // Changes custom data (or anything else outside the graph, like stdout)
+	lfr_nondeterministic = 1 << 3, // Same input may give different output (random numbers and such)
+	lfr_yields = 1 << 4, // May stop or redirect flow (not return `lfr_continue`, or request nodes itself)
+} lfr_instruction_flag_e;
+
 typedef struct lfr_instruction_def_ {
 	const char *name;
 	lfr_result_e (*func)(lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *);
-	struct {
-		const char* name;
-		lfr_variant_t data;
-	} input_signature[lfr_signature_size], output_signature[lfr_signature_size];
+
+	// Declared slots are all slots up to the last one with a name or default (`func` only gets those)
+	lfr_slot_def_t input_signature[lfr_signature_size], output_signature[lfr_signature_size];
+
+	// Optional: Process a whole batch at once (must do the same as `func` for every state in the batch),
+	// only used by `lfr_step_world_batched()`
+	void (*batch_func)(lfr_batch_t *);
+
+	// Optional: How costly processing is (for budgeted stepping, zero counts as one)
+	unsigned cost;
+
+	// Optional: Never coalesce requests for nodes with this instruction (see `lfr_set_node_coalescing()`)
+	bool every_event;
+
+	// Optional: What the instruction does (see `lfr_instruction_flag_e`, pure ones are folded by `lfr_compile_graph()`)
+	unsigned flags;
 } lfr_instruction_def_t;
 
 typedef struct lfr_vm_ {
@@ -230,50 +426,229 @@ const struct lfr_instruction_def_* lfr_get_instruction(unsigned, const lfr_vm_t
 const struct lfr_instruction_def_* lfr_get_core_instruction(lfr_instruction_e, const lfr_vm_t *);
 const struct lfr_instruction_def_* lfr_get_custom_instruction(unsigned, const lfr_vm_t *);
 
+// Vectorized math in batches (define `LFR_SIMD` and include `immintrin.h` to enable on x86)
+typedef enum lfr_simd_ {
+	lfr_simd_none,
+	lfr_simd_sse2,
+	lfr_simd_avx2,
+	lfr_no_simd_levels // Not a level :P
+} lfr_simd_e;
+
+lfr_simd_e lfr_get_simd_level(void);
+void lfr_limit_simd_level(lfr_simd_e);
+
 
 //// LFR Node state ////
 
+/*
+Values of a node in a graph state.
+
+The row owns a run of the value pool: its outputs, followed by its fixed (or default) input values.
+Each input is bound to the value it reads (a linked output, or its own value if not linked),
+so processing the node is a plain copy of inputs and no links or defaults have to be looked up.
+Bindings are redone when the node table has changed since (see `revision` of the node table).
+*/
 typedef struct lfr_node_state_ {
-	lfr_variant_t output_data[lfr_signature_size];
+	lfr_node_id_t node; // Node the row belongs to (no id while the row has no values)
+	unsigned first_value;
+	unsigned char num_outputs, num_inputs;
+	unsigned revision; // Node table revision the inputs were bound at
 } lfr_node_state_t;
 
-typedef struct lfr_node_state_table_ {
-	// Meta fields (auxiliary table)
-	unsigned sparse_id[lfr_node_table_id_range];
-	lfr_node_id_t dense_id[lfr_node_table_max_rows];
-	unsigned num_rows;
+/*
+Node states of a graph, kept on the same rows as the nodes in the node table.
 
+Rows follow the node table as it was at `revision`,
+and are moved (and values compacted) to catch up when the node table has changed.
+Only stepping (or binding) the state does that, reads through a const state that lags search for rows.
+*/
+typedef struct lfr_node_state_table_ {
 	// Data column(s)
-	lfr_node_state_t node_state[lfr_node_table_max_rows];
-
+	lfr_node_state_t *node_state;
+	unsigned *has_run; // One bit per row (has the node been processed?)
+	unsigned num_rows, max_rows, revision;
+
+	// Value pool (a run of output and input values per row)
+	lfr_variant_t *value;
+	unsigned *source; // Value read by each input (unused for outputs)
+	unsigned num_values, max_values;
 } lfr_node_state_table_t;
 
+// Node state table memory
+void lfr_reserve_node_state_table_rows(unsigned num_rows, lfr_node_state_table_t *);
+void lfr_shrink_node_state_table(lfr_node_state_table_t *);
+void lfr_term_node_state_table(lfr_node_state_table_t *);
+
 // Node state CRUD
-unsigned lfr_insert_node_state_at(lfr_node_id_t, const lfr_node_table_t*, lfr_node_state_table_t*);
-bool lfr_node_state_table_contains(lfr_node_id_t, const lfr_node_state_table_t*);
+unsigned lfr_insert_node_state_at(lfr_node_id_t, const lfr_vm_t *, const lfr_node_table_t*, lfr_node_state_table_t*);
+bool lfr_node_state_table_contains(lfr_node_id_t, const lfr_node_table_t*, const lfr_node_state_table_t*);
+
+
+//// LFR Node queue ////
+
+typedef struct lfr_queued_node_ {
+	lfr_node_id_t node;
+	unsigned work;
+} lfr_queued_node_t;
+
+/**
+What to do when a node is pushed to a queue that has reached its limit.
+
+ - grow: Ignore the limit and grow the queue (never looses work)
+ - block: Refuse new entries from the host (flows already running still grow the queue)
+ - coalesce: Skip entries identical to one already in the queue, otherwise grow
+ - drop_oldest: Make room by dropping the first entry in the queue
+**/
+typedef enum lfr_queue_policy_ {
+	lfr_queue_grow,
+	lfr_queue_block,
+	lfr_queue_coalesce,
+	lfr_queue_drop_oldest,
+	lfr_no_queue_policies // Not a policy :P
+} lfr_queue_policy_e;
+
+/*
+Growable FIFO ring buffer (capacity is always zero or a power of two).
+*/
+typedef struct lfr_node_queue_ {
+	lfr_queued_node_t *entries;
+	unsigned head, num_entries, max_entries;
+	unsigned num_taken; // Entries taken from the front so far (position of the first entry)
+
+	// Overflow handling
+	lfr_queue_policy_e policy;
+	unsigned limit;
+
+	// Statistics (for sizing queues)
+	unsigned peak_entries;
+	unsigned num_blocked, num_coalesced, num_dropped;
+} lfr_node_queue_t;
+
+bool lfr_push_node_queue(lfr_queued_node_t, lfr_node_queue_t *);
+bool lfr_pop_node_queue(lfr_node_queue_t *, lfr_queued_node_t *);
+lfr_queued_node_t lfr_peek_node_queue(unsigned, const lfr_node_queue_t *);
+void lfr_term_node_queue(lfr_node_queue_t *);
+
+/*
+Where the last request for a node was queued (see `lfr_set_node_coalescing()`).
+*/
+typedef struct lfr_queued_mark_ {
+	unsigned gen; // Generation of the node (zero for none)
+	unsigned position; // Position in the queue (counting every entry ever pushed to it)
+	unsigned queue; // Lane (or `lfr_no_priorities` for the deferred queue)
+} lfr_queued_mark_t;
+
+
+//// LFR Timer wheel ////
+
+enum {lfr_wheel_levels = 6, lfr_wheel_bits = 6, lfr_wheel_slots = 1 << lfr_wheel_bits};
+
+typedef struct lfr_timer_ {
+	lfr_queued_node_t entry;
+	lfr_time_t wake_time;
+	unsigned next; // Next timer in the same slot (or free list)
+	unsigned char lane; // Scheduled lane to wake up in
+} lfr_timer_t;
+
+/*
+Hierarchical timer wheel of sleeping nodes (see `lfr_sleep`).
+
+Slots of level `l` are 64^l microseconds wide. Timers are kept on the lowest level
+where they are in a later slot than the current time of the wheel
+(the ones further away than the top level can reach wait in a separate list).
+When the wheel reaches a slot its timers either wake up or move down a level,
+so each timer is only touched a few times however long it sleeps.
+*/
+typedef struct lfr_timer_wheel_ {
+	lfr_timer_t *timers;
+	unsigned num_timers, max_timers; // Pool (unused timers are in the free list)
+	unsigned num_sleeping;
+
+	// First timer of each slot (then the far list and the free list), allocated when first used
+	unsigned *first;
+	unsigned long long occupied[lfr_wheel_levels]; // One bit per non-empty slot
+
+	lfr_time_t now;
+} lfr_timer_wheel_t;
+
+void lfr_term_timer_wheel(lfr_timer_wheel_t *);
+
+
+//// LFR Signal waits ////
+
+// Signals are small numbers (they index a table)
+enum {lfr_max_signals = 1 << 16};
+
+typedef struct lfr_signal_waiter_ {
+	lfr_queued_node_t entry;
+	unsigned next; // Next waiter for the same signal (or in the free list)
+	unsigned char lane; // Scheduled lane to wake up in
+} lfr_signal_waiter_t;
+
+/*
+Nodes waiting for signals (see `lfr_await`), one list per signal.
+*/
+typedef struct lfr_signal_waits_ {
+	lfr_signal_waiter_t *waiters;
+	unsigned num_waiters, max_waiters, free_waiter; // Pool (unused waiters are in the free list)
+	unsigned num_waiting;
+
+	// Last waiter of each signal (UINT_MAX for none)
+	unsigned *last;
+	unsigned signal_range;
+} lfr_signal_waits_t;
+
+void lfr_term_signal_waits(lfr_signal_waits_t *);
 
 
 //// LFR Graph state ////
 
-enum { lfr_graph_state__max_queue = 8};
 typedef struct lfr_graph_state_ {
-	// Scheduled
-	lfr_node_id_t schedueled_nodes[lfr_graph_state__max_queue];
-	unsigned num_schedueled_nodes;
+	// Scheduled (one lane per priority)
+	lfr_node_queue_t schedueled_nodes[lfr_no_priorities];
 
 	// Deferred
-	struct {
-		lfr_node_id_t node;
-		unsigned work;
-	} deferred_nodes[lfr_graph_state__max_queue];
-	unsigned num_deferred_nodes;
+	lfr_node_queue_t deferred_nodes;
+
+	// Sleeping (see `lfr_sleep`) or waiting for signals (see `lfr_await`)
+	lfr_timer_wheel_t sleeping_nodes;
+	lfr_signal_waits_t awaiting_nodes;
+
+	// Coalescing (see `lfr_set_node_coalescing()`)
+	const lfr_vm_t *coalescing; // Instructions to check (NULL when not coalescing)
+	lfr_queued_mark_t *queued_marks; // One per node id
+	unsigned marks_range;
+
+	// Flow targets to process right away in a row (see `lfr_set_direct_flow()`)
+	unsigned max_direct_depth;
+
+	// Budgeted stepping (see `lfr_step_budget()`)
+	unsigned num_carried[lfr_no_priorities + 1]; // Entries left over in each lane (then deferred), these go first
+	unsigned busy_steps; // Steps taken since nothing was scheduled
 
 	// Node data (processing results)
 	lfr_node_state_table_t nodes;
 
-	float time;
+	// Node data when running a compiled program (see `lfr_bind_program()`)
+	const struct lfr_program_ *program;
+	unsigned program_serial; // Serial of the program when it was bound
+	lfr_variant_t *program_values;
+	unsigned num_program_values;
+	unsigned *program_has_run; // One bit per op (has it been processed since binding?)
+
+	// Host context for this state (NULL to use the one in the vm)
+	void *custom_data;
+
+	// Random number generator state (seed it with any number, zero picks a fixed seed)
+	unsigned random_state;
+
+	lfr_time_t clock; // Microseconds
+	float time; // Same as clock (in seconds)
+	bool stepping;
 } lfr_graph_state_t;
 
+void lfr_init_graph_state(lfr_graph_state_t *);
+void lfr_term_graph_state(lfr_graph_state_t *);
 
 // Data slots
 lfr_variant_t lfr_get_input_value(lfr_node_id_t, unsigned slot,
@@ -281,25 +656,231 @@ lfr_variant_t lfr_get_input_value(lfr_node_id_t, unsigned slot,
 lfr_variant_t lfr_get_output_value(lfr_node_id_t, unsigned slot,
 	const lfr_vm_t *, const lfr_graph_t*, const lfr_graph_state_t*);
 
+// Queue depth
+unsigned lfr_count_scheduled_nodes(const lfr_graph_state_t *);
+unsigned lfr_count_deferred_nodes(const lfr_graph_state_t *);
+unsigned lfr_count_sleeping_nodes(const lfr_graph_state_t *);
+unsigned lfr_count_awaiting_nodes(const lfr_graph_state_t *);
+const lfr_node_queue_t *lfr_peek_scheduled_nodes(const lfr_graph_state_t *);
+
+// Signals (wake up nodes waiting for them)
+unsigned lfr_raise_signal(unsigned signal, lfr_graph_state_t *);
+
+// Queue overflow
+void lfr_set_queue_policy(lfr_queue_policy_e, unsigned limit, lfr_graph_state_t *);
+void lfr_set_node_coalescing(const lfr_vm_t *, lfr_graph_state_t *);
+
+// Flow shortcuts
+void lfr_set_direct_flow(unsigned max_depth, lfr_graph_state_t *);
+
 // Time is (not always) the same for everyone
 void lfr_forward_state_time(float dt, lfr_graph_state_t *);
+void lfr_forward_state_clock(lfr_time_t dt, lfr_graph_state_t *);
 
 
 //// LFR script execution ////
 
 // Scheduling (do this as soon as possible)
-void lfr_schedule_instruction(unsigned instruction, const lfr_graph_t *, lfr_graph_state_t *);
-void lfr_schedule_node(lfr_node_id_t, const lfr_graph_t *, lfr_graph_state_t *);
+unsigned lfr_schedule_instruction(unsigned instruction, const lfr_graph_t *, lfr_graph_state_t *);
+bool lfr_schedule_node(lfr_node_id_t, const lfr_graph_t *, lfr_graph_state_t *);
 
 // Defering (do this after everything scheduled)
-void lfr_defer_instruction(unsigned instruction, unsigned work, const lfr_graph_t *, lfr_graph_state_t *);
-void lfr_defer_node(lfr_node_id_t, unsigned work, const lfr_graph_t *, lfr_graph_state_t *);
+unsigned lfr_defer_instruction(unsigned instruction, unsigned work, const lfr_graph_t *, lfr_graph_state_t *);
+bool lfr_defer_node(lfr_node_id_t, unsigned work, const lfr_graph_t *, lfr_graph_state_t *);
 
 // Actually do tings
 void lfr_step(const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *);
 lfr_result_e lfr_process_node_instruction(unsigned inst, lfr_node_id_t,
 	const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *, unsigned *work);
 
+// Do many things at once
+typedef struct lfr_run_stats_ {
+	unsigned num_steps; // Nodes taken from the queues
+	unsigned num_scheduled, num_deferred; // Nodes still queued afterwards
+	unsigned num_sleeping; // Nodes waiting for the clock afterwards
+	unsigned num_awaiting; // Nodes waiting for signals afterwards
+	unsigned cost; // Cost of the nodes processed (see `cost` in instruction definitions)
+	lfr_node_id_t runaway; // Node being processed when a flow was found running away (budgeted steps only)
+} lfr_run_stats_t;
+
+/*
+Limits of a budgeted step (zero or NULL for no limit).
+*/
+typedef struct lfr_budget_ {
+	unsigned max_cost; // Cost of nodes to process at most (zero for no limit)
+	bool (*out_of_time)(void *data); // Stop when this returns true (checked before every node)
+	void *data;
+	unsigned max_busy_steps; // Flows busy for this many steps (in a row) are reported as running away (zero never)
+} lfr_budget_t;
+
+lfr_run_stats_t lfr_step_n(unsigned max_steps, const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *);
+lfr_run_stats_t lfr_run_until_idle(const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *);
+lfr_run_stats_t lfr_step_budget(const lfr_budget_t *, const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *);
+
+
+//// LFR Compiled programs ////
+
+/*
+Node compiled into a program operation.
+
+Inputs and outputs are offsets into the value array of the graph state,
+so no links or defaults have to be looked up when the operation is processed.
+*/
+typedef struct lfr_program_op_ {
+	lfr_node_id_t node_id;
+	lfr_result_e (*func)(lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *);
+	unsigned first_input; // Value offsets of input slots (in program `inputs`)
+	unsigned output; // Value offset of first output slot (the rest follow)
+	unsigned char num_inputs, num_outputs;
+	unsigned char priority; // Lane flow targets of other ops are scheduled in (see `lfr_priority_e`)
+	bool every_event; // Never coalesce requests for the op (see `every_event` in instruction definitions)
+	bool folded; // Outputs are constant and already in program `values` (the op is never processed)
+	unsigned first_target, num_targets; // Flow targets (in program `targets`)
+} lfr_program_op_t;
+
+/*
+A graph frozen into a flat list of operations (one per node, in node table order).
+
+Values are laid out as all outputs (as many as each operation has)
+followed by the fixed inputs (in the same order as `inputs`).
+The program refers to the graph and is invalid once the graph (or vm) is changed.
+*/
+typedef struct lfr_program_ {
+	const lfr_vm_t *vm;
+	const lfr_graph_t *graph;
+	unsigned serial; // Unique for every compilation (tells a recompiled program from the old one)
+
+	// Operations
+	lfr_program_op_t *ops;
+	unsigned num_ops, num_folded;
+	unsigned *op_index, id_range; // Node id number to operation
+
+	// Input value offsets of all operations
+	unsigned *inputs;
+	unsigned num_inputs;
+
+	// Flow targets of all operations
+	lfr_node_id_t *targets;
+	unsigned num_targets;
+
+	// Initial values (copied to graph state when bound)
+	lfr_variant_t *values;
+	unsigned num_values;
+} lfr_program_t;
+
+lfr_program_t lfr_compile_graph(const lfr_vm_t *, const lfr_graph_t *);
+void lfr_term_program(lfr_program_t *);
+void lfr_bind_program(const lfr_program_t *, lfr_graph_state_t *);
+void lfr_step_program(const lfr_program_t *, lfr_graph_state_t *);
+
+
+//// LFR World ////
+
+typedef struct lfr_world_instance_ {
+	lfr_graph_state_t state;
+	bool active;
+} lfr_world_instance_t;
+
+/*
+One (immutable) graph run by many instances, each with a graph state of its own.
+
+Only active instances (the ones with queued nodes) are stepped,
+so idle instances cost nothing but their memory.
+*/
+typedef struct lfr_world_ {
+	const lfr_vm_t *vm;
+	const lfr_graph_t *graph;
+	const lfr_program_t *program; // Optional (NULL to interpret the graph)
+
+	// Instances
+	lfr_world_instance_t *instances;
+	unsigned num_instances, max_instances;
+
+	// Active set (instance numbers)
+	unsigned *active;
+	unsigned num_active;
+
+	// Scratch memory for batched stepping (see `lfr_step_world_batched()`)
+	struct {
+		lfr_queued_node_t *entries; // Batched node each active instance is at
+		unsigned *order, *steps, *busy, *row, *group_start;
+		unsigned max_entries, max_groups, max_column_values;
+		lfr_variant_t *columns;
+		lfr_process_env_i *env;
+		lfr_result_e *result;
+	} batch;
+
+	lfr_time_t clock; // Microseconds
+	float time; // Same as clock (in seconds)
+} lfr_world_t;
+
+void lfr_init_world(const lfr_vm_t *, const lfr_graph_t *, const lfr_program_t *, lfr_world_t *);
+void lfr_term_world(lfr_world_t *);
+
+// Instances
+unsigned lfr_add_world_instance(void *custom_data, lfr_world_t *);
+lfr_graph_state_t* lfr_get_world_instance_state(unsigned instance, lfr_world_t *);
+void lfr_wake_world_instance(unsigned instance, lfr_world_t *);
+
+// Scheduling and defering
+unsigned lfr_schedule_world_instruction(unsigned instruction, unsigned instance, lfr_world_t *);
+unsigned lfr_defer_world_instruction(unsigned instruction, unsigned work, unsigned instance, lfr_world_t *);
+unsigned lfr_broadcast_world_instruction(unsigned instruction, lfr_world_t *);
+unsigned lfr_raise_world_signal(unsigned signal, unsigned instance, lfr_world_t *);
+unsigned lfr_broadcast_world_signal(unsigned signal, lfr_world_t *);
+
+// Actually do things
+void lfr_forward_world_time(float dt, lfr_world_t *);
+void lfr_forward_world_clock(lfr_time_t dt, lfr_world_t *);
+unsigned lfr_step_world(unsigned max_steps, lfr_world_t *);
+unsigned lfr_step_world_batched(unsigned max_steps, lfr_world_t *);
+
+
+//// LFR Worker pool ////
+#ifdef LFR_THREADS
+/*
+Opt in by defining `LFR_THREADS` (and including `pthread.h` and `stdatomic.h`) before including LFR.
+*/
+
+/*
+Worker thread (the calling thread is the last worker in every pool).
+
+Each worker gets a share of the items in every job, then steals from the other workers when done.
+*/
+typedef struct lfr_worker_ {
+	_Alignas(64) atomic_uint next; // Next item to take (by owner or thief)
+	unsigned end; // End of share
+	unsigned num_steps;
+	struct lfr_worker_pool_ *pool;
+	pthread_t thread;
+} lfr_worker_t;
+
+typedef struct lfr_worker_pool_ {
+	lfr_worker_t *workers;
+	unsigned num_workers;
+
+	// Current job
+	unsigned (*job)(unsigned item, void *data);
+	void *job_data;
+
+	// Synchronization
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready, job_done;
+	unsigned job_number, num_working;
+	bool quit;
+} lfr_worker_pool_t;
+
+void lfr_init_worker_pool(unsigned num_threads, lfr_worker_pool_t *);
+void lfr_term_worker_pool(lfr_worker_pool_t *);
+
+// Parallel stepping
+unsigned lfr_run_worker_pool(unsigned num_items, unsigned (*job)(unsigned item, void *data), void *,
+	lfr_worker_pool_t *);
+unsigned lfr_step_states_in_pool(unsigned max_steps, lfr_graph_state_t **states, unsigned num_states,
+	const lfr_vm_t *, const lfr_graph_t *, const lfr_program_t *, lfr_worker_pool_t *);
+unsigned lfr_step_world_in_pool(unsigned max_steps, lfr_world_t *, lfr_worker_pool_t *);
+
+#endif
 #endif
 
 
@@ -311,7 +892,12 @@ lfr_result_e lfr_process_node_instruction(unsigned inst, lfr_node_id_t,
 
 //// Sparce table macros ////
 #define T_HAS_ID(t, r) \
-	((t).sparse_id[(r).id] < (t).num_rows && (t).dense_id[(t).sparse_id[(r).id]].id == (r).id)
+	((r).id < (t).id_range && (t).sparse_id[(r).id] < (t).num_rows \
+		&& T_SAME_ID((t).dense_id[(t).sparse_id[(r).id]], (r)))
+
+/* Is the id handle still alive in the table? (Tables with generations only.) */
+#define T_IS_LIVE(t, r) \
+	((r).id < (t).id_range && (t).generation[(r).id] == (r).gen && ((r).gen & 1))
 
 #define T_INDEX(t,r) \
 	(assert(T_HAS_ID((t), (r))), (t).sparse_id[(r).id])
@@ -321,15 +907,36 @@ lfr_result_e lfr_process_node_instruction(unsigned inst, lfr_node_id_t,
 
 /* Compare two ids. True if they are the same. */
 #define T_SAME_ID(a,b) \
-	((a).id == (b).id)
-
-/* Add a new row to the sparse table, returning the index of the row.*/
-#define T_INSERT_ROW(t, id_type) \
-	((t).dense_id[(t).num_rows] = (id_type){(t).next_id}, (t).sparse_id[(t).next_id++] = (t).num_rows++)
+	((a).id == (b).id && (a).gen == (b).gen)
 
 #define T_FOR_ROWS(r,t) \
 	for (unsigned r = 0; r < (t).num_rows; r++)
 
+/* Resize a (growable) column to hold the given number of rows. */
+#define T_RESIZE_COLUMN(c, n) \
+	((c) = realloc((c), sizeof(*(c)) * (n)), assert((c) || !(n)))
+
+
+//// Growth helpers ////
+
+/* Smallest power of two capacity (starting at 16) that fits the given number of items. */
+unsigned lfr_grow_capacity_(unsigned current, unsigned needed) {
+	unsigned capacity = (current ? current : 16);
+	while (capacity < needed) { capacity *= 2; }
+	return capacity;
+}
+
+/* Grow sparse id lookup so that it can hold the given id, marking new entries as unused. */
+unsigned* lfr_grow_sparse_ids_(unsigned id, unsigned *sparse_id, unsigned *id_range) {
+	if (id < *id_range) { return sparse_id; }
+
+	unsigned new_range = lfr_grow_capacity_(*id_range, id + 1);
+	T_RESIZE_COLUMN(sparse_id, new_range);
+	for (unsigned i = *id_range; i < new_range; i++) { sparse_id[i] = UINT_MAX; }
+	*id_range = new_range;
+	return sparse_id;
+}
+
 
 //// Utility macros ////
 /* Log from a function, including the function name in the string. */
@@ -337,6 +944,73 @@ lfr_result_e lfr_process_node_instruction(unsigned inst, lfr_node_id_t,
 	printf("# %s():\t" m "\n", __func__, __VA_ARGS__);
 
 //// Internals (defined further down) ////
+unsigned lfr_add_to_node_group_(unsigned key, lfr_node_id_t, unsigned tag, lfr_node_groups_t *);
+lfr_node_id_t lfr_remove_from_node_group_(unsigned key, unsigned at, lfr_node_groups_t *);
+void lfr_cut_from_node_group_(unsigned key, unsigned at, lfr_node_groups_t *);
+unsigned lfr_find_in_node_group_(unsigned key, lfr_node_id_t, const lfr_node_groups_t *);
+unsigned lfr_get_node_group_(unsigned key, const lfr_node_groups_t *, const lfr_node_id_t **);
+void lfr_term_node_groups_(lfr_node_groups_t *);
+void lfr_link_data_in_table_(lfr_node_id_t, unsigned, lfr_node_id_t, unsigned, lfr_node_table_t *);
+void lfr_unlink_input_data_in_table_(unsigned index, unsigned slot, lfr_node_table_t *);
+void lfr_unlink_output_data_in_table_(unsigned index, unsigned slot, lfr_node_table_t *);
+unsigned lfr_input_slot_(unsigned index, unsigned slot, const lfr_node_table_t *);
+void lfr_compact_node_slots_(lfr_node_table_t *);
+unsigned lfr_output_slot_(unsigned index, unsigned slot, const lfr_node_table_t *);
+bool lfr_push_node_queue_(lfr_queued_node_t, bool may_block, lfr_node_queue_t *);
+bool lfr_push_request_(lfr_queued_node_t, unsigned queue, bool every_event, lfr_graph_state_t *);
+bool lfr_is_request_waiting_(lfr_node_id_t, unsigned queue, const lfr_graph_state_t *);
+bool lfr_sees_every_event_(lfr_node_id_t, const lfr_graph_t *, const lfr_graph_state_t *);
+unsigned lfr_get_flow_targets_(lfr_node_id_t, const lfr_graph_t *, const lfr_graph_state_t *, const lfr_node_id_t **);
+bool lfr_may_run_directly_(lfr_node_id_t, unsigned lane, bool every_event, const lfr_graph_state_t *);
+unsigned lfr_find_program_op_(lfr_node_id_t, const lfr_program_t *);
+const lfr_program_t *lfr_get_bound_program_(const lfr_graph_state_t *);
+void lfr_write_back_program_values_(const lfr_program_t *, lfr_graph_state_t *);
+void lfr_fold_program_constants_(lfr_program_t *);
+void lfr_add_program_target_(lfr_node_id_t, unsigned *max_targets, lfr_program_t *);
+void* lfr_get_custom_data_(const lfr_vm_t *, const lfr_graph_state_t *);
+float lfr_random_float_(unsigned *random_state);
+unsigned lfr_step_state_(unsigned max_steps, const lfr_vm_t *, const lfr_graph_t *,
+	const lfr_program_t *, lfr_graph_state_t *);
+void lfr_drop_idle_world_instances_(lfr_world_t *);
+void lfr_follow_result_(lfr_result_e, lfr_node_id_t, unsigned work, const lfr_graph_t *, lfr_graph_state_t *);
+unsigned lfr_step_node_(lfr_queued_node_t, const lfr_budget_t *, unsigned spent,
+	const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *);
+bool lfr_is_out_of_budget_(const lfr_budget_t *, unsigned cost);
+lfr_run_stats_t lfr_run_(unsigned max_steps, bool until_idle, const lfr_budget_t *,
+	const lfr_vm_t *, const lfr_graph_t *, lfr_graph_state_t *);
+lfr_node_queue_t *lfr_next_scheduled_lane_(lfr_graph_state_t *);
+bool lfr_pop_next_node_(lfr_graph_state_t *, lfr_queued_node_t *);
+lfr_node_queue_t *lfr_take_carried_lane_(lfr_graph_state_t *);
+void lfr_suspend_node_(lfr_result_e, unsigned lane, const lfr_process_env_i *, lfr_graph_state_t *);
+void lfr_sleep_node_(lfr_queued_node_t, unsigned lane, lfr_time_t wake_time, lfr_graph_state_t *);
+void lfr_await_signal_(lfr_queued_node_t, unsigned lane, unsigned signal, lfr_graph_state_t *);
+void lfr_insert_timer_(unsigned timer, lfr_graph_state_t *);
+lfr_time_t lfr_next_timer_slot_(const lfr_timer_wheel_t *, unsigned *list);
+void lfr_set_state_clock_(lfr_time_t, lfr_graph_state_t *);
+lfr_time_t lfr_seconds_to_clock_(float);
+float lfr_clock_to_seconds_(lfr_time_t);
+void lfr_bind_node_state_inputs_(unsigned state_index, const lfr_vm_t *, const lfr_node_table_t *, lfr_node_state_table_t *);
+void lfr_sync_node_state_rows_(const lfr_node_table_t *, lfr_node_state_table_t *);
+void lfr_extend_node_state_rows_(unsigned num_rows, lfr_node_state_table_t *);
+unsigned lfr_find_node_state_(lfr_node_id_t, const lfr_node_table_t *, const lfr_node_state_table_t *);
+unsigned lfr_count_signature_slots_(const lfr_slot_def_t signature[]);
+bool lfr_step_to_batched_node_(unsigned active, unsigned max_steps, lfr_world_t *);
+void lfr_process_batch_(unsigned first, unsigned size, unsigned max_steps, unsigned *num_busy, lfr_world_t *);
+lfr_simd_e lfr_detect_simd_level_(void);
+#ifdef LFR_CHECK_INSTRUCTIONS
+/* What is needed to check an instruction once it has been processed (see `lfr_instruction_flag_e`). */
+typedef struct lfr_instruction_check_ {
+	const lfr_instruction_def_t *def;
+	const lfr_process_env_i *env;
+	lfr_variant_t input[lfr_signature_size];
+	unsigned work, num_queued;
+} lfr_instruction_check_t;
+lfr_instruction_check_t lfr_begin_instruction_check_(const lfr_instruction_def_t *,
+	const lfr_variant_t input[], const lfr_process_env_i *);
+void lfr_end_instruction_check_(const lfr_instruction_check_t *, const lfr_variant_t output[], lfr_result_e);
+bool lfr_same_variant_(lfr_variant_t, lfr_variant_t);
+bool lfr_same_float_(float, float);
+#endif
 
 
 
@@ -349,30 +1023,33 @@ This is usefull for start of flows this should be scheduled ever so often.
 The instruction `lfr_tick`exists for this purpouse.
 If you need to suport multiple intervalls (eg. every frame and every second)
 then it's probably best to introduce your own custom instructions.
+
+Returns the number of nodes that actually got scheduled (see `lfr_set_queue_policy()`).
 **/
-void lfr_schedule_instruction(unsigned instruction, const lfr_graph_t *graph, lfr_graph_state_t *state) {
-	T_FOR_ROWS(node_index, graph->nodes) {
-		unsigned node_instruction = graph->nodes.node[node_index].instruction;
-		if (instruction != node_instruction) { continue; }
-		lfr_node_id_t id = T_ID(graph->nodes, node_index);
-		lfr_schedule_node(id, graph, state);
+unsigned lfr_schedule_instruction(unsigned instruction, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+	const lfr_node_id_t *nodes;
+	unsigned num_nodes = lfr_get_nodes_with_instruction(instruction, &graph->nodes, &nodes);
+	unsigned count = 0;
+	for (unsigned i = 0; i < num_nodes; i++) {
+		count += lfr_schedule_node(nodes[i], graph, state);
 	}
+	return count;
 }
 
 
 /**
-Enqueue a node to process to the script executions todo-list (as long as there is space left in the queue).
+Enqueue a node to process to the script executions todo-list.
 
-Scheduled nodes are processed before deferred when steping throuh a graph.
+Scheduled nodes are processed before deferred when steping throuh a graph
+(in the lane of their priority, higher lanes first).
+Returns false if the queue policy refused the node.
 **/
-void lfr_schedule_node(lfr_node_id_t node_id, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+bool lfr_schedule_node(lfr_node_id_t node_id, const lfr_graph_t *graph, lfr_graph_state_t *state) {
 	assert(graph && state);
-	assert(T_HAS_ID(graph->nodes, node_id));
-	if (state->num_schedueled_nodes >= lfr_graph_state__max_queue) {
-		fprintf(stderr, "%s(): Node queue is full!\n", __func__);
-		return;
-	}
-	state->schedueled_nodes[state->num_schedueled_nodes++]= node_id;
+	assert(T_IS_LIVE(graph->nodes, node_id));
+	lfr_queued_node_t entry = {node_id, 0};
+	unsigned lane = graph->nodes.node[T_INDEX(graph->nodes, node_id)].priority;
+	return lfr_push_request_(entry, lane, lfr_sees_every_event_(node_id, graph, state), state);
 }
 
 
@@ -387,11 +1064,27 @@ void lfr_schedule_node_flow_targets(lfr_node_id_t node_id,
 	assert(graph && state);
 
 	// Shedule all tartets of flow links where the given node is the source
-	for (int i =0; i < graph->num_flow_links; i++) {
-		const lfr_flow_link_t * link = &graph->flow_links[i];
-		if (!T_SAME_ID(link->source_node, node_id)) { continue; }
-		lfr_schedule_node(link->target_node, graph, state);
+	const lfr_node_id_t *targets;
+	unsigned num_targets = lfr_get_flow_targets_(node_id, graph, state, &targets);
+	for (unsigned i = 0; i < num_targets; i++) {
+		lfr_schedule_node(targets[i], graph, state);
+	}
+}
+
+
+/*
+Get the flow targets of the given node, the way the bound program has them if it runs the node
+(its flow leaves folded nodes out).
+*/
+unsigned lfr_get_flow_targets_(lfr_node_id_t node_id, const lfr_graph_t *graph, const lfr_graph_state_t *state,
+		const lfr_node_id_t **targets) {
+	const lfr_program_t *program = lfr_get_bound_program_(state);
+	unsigned op = (program && program->graph == graph ? lfr_find_program_op_(node_id, program) : UINT_MAX);
+	if (op != UINT_MAX) {
+		*targets = &program->targets[program->ops[op].first_target];
+		return program->ops[op].num_targets;
 	}
+	return lfr_get_node_flow_targets(node_id, graph, targets);
 }
 
 
@@ -400,15 +1093,19 @@ Defer processing all nodes with the given instruction with the given work data.
 
 This is most usefull for triggerin events, i.e. things that happen in the game world that
 som script may (or may not) want to react to.
+
+Returns the number of nodes that actually got deferred (see `lfr_set_queue_policy()`).
 **/
-void lfr_defer_instruction(unsigned inst, unsigned work, const lfr_graph_t *graph, lfr_graph_state_t *state) {
-	T_FOR_ROWS(node_index, graph->nodes) {
-		unsigned node_instruction = graph->nodes.node[node_index].instruction;
-		if (inst != node_instruction) { continue; }
-		lfr_node_id_t id = T_ID(graph->nodes, node_index);
-		lfr_defer_node(id, work, graph, state);
+unsigned lfr_defer_instruction(unsigned inst, unsigned work, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+	const lfr_node_id_t *nodes;
+	unsigned num_nodes = lfr_get_nodes_with_instruction(inst, &graph->nodes, &nodes);
+	unsigned count = 0;
+	for (unsigned i = 0; i < num_nodes; i++) {
+		count += lfr_defer_node(nodes[i], work, graph, state);
 	}
+	return count;
 }
+
 /**
 Continue processing given node a little later.
 
@@ -420,74 +1117,322 @@ Mainly for internal usage when a node needs to be processed several times
 with information carried form one iteration to the next.
 Flow control instructions  (like `repeat`) can sometimes have surprising
 behaviour if processed again to soon.
+
+Returns false if the queue policy refused the node.
 **/
-void lfr_defer_node(lfr_node_id_t node_id, unsigned work,
+bool lfr_defer_node(lfr_node_id_t node_id, unsigned work,
 		const lfr_graph_t *graph, lfr_graph_state_t *state) {
 	assert(graph && state);
-	assert(T_HAS_ID(graph->nodes, node_id));
-	if (state->num_deferred_nodes >= lfr_graph_state__max_queue) {
-		fprintf(stderr, "%s(): Node queue is full!\n", __func__);
-		return;
+	assert(T_IS_LIVE(graph->nodes, node_id));
+	lfr_queued_node_t entry = {node_id, work};
+	return lfr_push_request_(entry, lfr_no_priorities, lfr_sees_every_event_(node_id, graph, state), state);
+}
+
+
+/*
+Push request for node to the given lane (or `lfr_no_priorities` for the deferred queue),
+unless one is already waiting there when coalescing.
+*/
+bool lfr_push_request_(lfr_queued_node_t entry, unsigned queue_index, bool every_event, lfr_graph_state_t *state) {
+	lfr_node_queue_t *queue = (queue_index < lfr_no_priorities
+		? &state->schedueled_nodes[queue_index] : &state->deferred_nodes);
+	if (!state->coalescing || every_event) {
+		return lfr_push_node_queue_(entry, !state->stepping, queue);
 	}
-	state->deferred_nodes[state->num_deferred_nodes].node = node_id;
-	state->deferred_nodes[state->num_deferred_nodes].work = work;
-	state->num_deferred_nodes++;
+
+	// Make room for a mark
+	unsigned id = entry.node.id;
+	if (id >= state->marks_range) {
+		unsigned new_range = lfr_grow_capacity_(state->marks_range, id + 1);
+		T_RESIZE_COLUMN(state->queued_marks, new_range);
+		memset(&state->queued_marks[state->marks_range], 0, sizeof(lfr_queued_mark_t) * (new_range - state->marks_range));
+		state->marks_range = new_range;
+	}
+
+	if (lfr_is_request_waiting_(entry.node, queue_index, state)) {
+		queue->num_coalesced++;
+		return false;
+	}
+
+	if (!lfr_push_node_queue_(entry, !state->stepping, queue)) { return false; }
+	state->queued_marks[id] = (lfr_queued_mark_t) {entry.node.gen, queue->num_taken + queue->num_entries - 1, queue_index};
+	return true;
+}
+
+
+/*
+Check if a request for the node is still waiting in the given lane (or `lfr_no_priorities` for the deferred queue),
+going by its mark (unless taken, dropped or replaced since). Only coalescing keeps marks.
+*/
+bool lfr_is_request_waiting_(lfr_node_id_t node_id, unsigned queue_index, const lfr_graph_state_t *state) {
+	if (node_id.id >= state->marks_range) { return false; }
+	const lfr_node_queue_t *queue = (queue_index < lfr_no_priorities
+		? &state->schedueled_nodes[queue_index] : &state->deferred_nodes);
+	const lfr_queued_mark_t *mark = &state->queued_marks[node_id.id];
+	unsigned offset = mark->position - queue->num_taken;
+	return mark->gen == node_id.gen && mark->queue == queue_index && offset < queue->num_entries
+		&& T_SAME_ID(lfr_peek_node_queue(offset, queue).node, node_id);
+}
+
+
+/*
+Check if a flow target may be processed right away (see `lfr_set_direct_flow()`) instead of being scheduled
+in the given lane. Not while nodes wait in higher lanes, or while a request for the target still waits
+(scheduling it is then coalesced instead).
+*/
+bool lfr_may_run_directly_(lfr_node_id_t node_id, unsigned lane, bool every_event, const lfr_graph_state_t *state) {
+	for (unsigned higher = 0; higher < lane && higher < lfr_no_priorities; higher++) {
+		if (state->schedueled_nodes[higher].num_entries) { return false; }
+	}
+	return !state->coalescing || every_event || !lfr_is_request_waiting_(node_id, lane, state);
+}
+
+
+/*
+Check if requests for the node must never be coalesced (nothing to check when not coalescing).
+*/
+bool lfr_sees_every_event_(lfr_node_id_t node_id, const lfr_graph_t *graph, const lfr_graph_state_t *state) {
+	if (!state->coalescing) { return false; }
+	unsigned inst = graph->nodes.node[T_INDEX(graph->nodes, node_id)].instruction;
+	return lfr_get_instruction(inst, state->coalescing)->every_event;
 }
 
 
 /**
 Execute topmost scheduled node (if any) from the script executions todo-list.
+
+A state bound to a program is unbound first (see `lfr_bind_program()`), so nothing the program did is lost.
 **/
 void lfr_step(const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *state) {
 	assert(vm && graph && state);
+	if (state->program) { lfr_bind_program(NULL, state); }
+	lfr_sync_node_state_rows_(&graph->nodes, &state->nodes);
 
 	// Find the right node
 	// (prioritize scheduled over deferred)
-	lfr_node_id_t node_id;
-	unsigned work = 0;
-	if (state->num_schedueled_nodes) {
-		node_id = state->schedueled_nodes[0];
-
-		// Shuffle queue (inefficient)
-		state->num_schedueled_nodes--;
-		for (int i = 0; i < state->num_schedueled_nodes; i++) {
-			state->schedueled_nodes[i] = state->schedueled_nodes[i + 1];
-		}
-	} else if (state->num_deferred_nodes) {
-		node_id = state->deferred_nodes[0].node;
-		work = state->deferred_nodes[0].work;
-
-		// Shuffle queue (inefficient)
-		state->num_deferred_nodes--;
-		for (int i = 0; i < state->num_deferred_nodes; i++) {
-			state->deferred_nodes[i] = state->deferred_nodes[i + 1];
-		}
-	} else {
+	lfr_queued_node_t next;
+	if (!lfr_pop_next_node_(state, &next)) {
 		// Nothing to do
 		return;
 	}
 
-	// Skip node no longer in graph
-	if (!T_HAS_ID(graph->nodes, node_id)) {
-		fprintf(stderr, "%s():\t Skipping node [#%u] as it is no longer in this graph.\n"
-			, __func__, node_id.id);
-		return;
+	// Work that is already in flight is never blocked
+	state->stepping = true;
+	lfr_step_node_(next, NULL, 0, vm, graph, state);
+	state->stepping = false;
+}
+
+
+/*
+Process node taken from a queue (unless no longer in graph) and follow up on the result,
+returning the cost of the nodes processed (see `cost` in instruction definitions).
+
+Flows that do not branch are followed right away (see `lfr_set_direct_flow()`)
+while the budget (if any) lasts, counting what was spent before this node.
+*/
+unsigned lfr_step_node_(lfr_queued_node_t next, const lfr_budget_t *budget, unsigned spent,
+		const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+	unsigned cost = 0;
+	for (unsigned depth = 0;; depth++) {
+		// Skip node no longer in graph
+		if (!T_IS_LIVE(graph->nodes, next.node)) { return cost; }
+
+		// Process instruction
+		unsigned work = next.work;
+		const unsigned instruction = graph->nodes.node[T_INDEX(graph->nodes, next.node)].instruction;
+		lfr_result_e result = lfr_process_node_instruction(instruction, next.node, vm, graph, state, &work);
+		unsigned inst_cost = lfr_get_instruction(instruction, vm)->cost;
+		cost += (inst_cost ? inst_cost : 1);
+
+		// Follow single target right away (or queue as usual)
+		const lfr_node_id_t *targets;
+		if (result != lfr_continue || depth >= state->max_direct_depth
+			|| lfr_get_flow_targets_(next.node, graph, state, &targets) != 1
+			|| !T_IS_LIVE(graph->nodes, targets[0])
+			|| !lfr_may_run_directly_(targets[0], graph->nodes.node[T_INDEX(graph->nodes, targets[0])].priority,
+				lfr_sees_every_event_(targets[0], graph, state), state)
+			|| lfr_is_out_of_budget_(budget, spent + cost)) {
+			lfr_follow_result_(result, next.node, work, graph, state);
+			return cost;
+		}
+		next = (lfr_queued_node_t) {targets[0], 0};
 	}
+}
 
-	// Process instruction
-	const unsigned node_index = T_INDEX(graph->nodes, node_id);
-	const unsigned instruction = graph->nodes.node[node_index].instruction;
-	lfr_result_e result = lfr_process_node_instruction(instruction, node_id, vm, graph, state, &work);
 
-	// Enqueue different nodes depending on processing result
+/**
+Take (at most) the given number of steps, like calling `lfr_step()` that many times.
+
+Stops early when there is nothing left to do.
+Returns the number of steps taken and how many nodes are still queued.
+**/
+lfr_run_stats_t lfr_step_n(unsigned max_steps, const lfr_vm_t *vm, const lfr_graph_t *graph,
+		lfr_graph_state_t *state) {
+	assert(vm && graph && state);
+	return lfr_run_(max_steps, false, NULL, vm, graph, state);
+}
+
+
+/**
+Step until idle, that is until nothing is scheduled
+and every deferred node has had a turn since scheduled nodes were last processed
+(so nodes waiting for something, like time to pass, do not keep it going).
+
+Flows that never end (loops without waiting) never go idle, use `lfr_step_n()` for those.
+Returns the number of steps taken and how many nodes are still queued (deferred ones, as nothing is scheduled).
+**/
+lfr_run_stats_t lfr_run_until_idle(const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+	assert(vm && graph && state);
+	return lfr_run_(UINT_MAX, true, NULL, vm, graph, state);
+}
+
+
+/**
+Step until idle (like `lfr_run_until_idle()`) or out of budget, whichever comes first.
+
+The budget is checked before every node, so the last node may go over by its own cost.
+Nodes left over when running out of budget go first in the next budgeted step
+(in lane order, then deferred), so lower lanes and deferred nodes always get their turn eventually.
+Flows that keep going for `max_busy_steps` or more (over any number of budgeted steps)
+without ever emptying the scheduled lanes are reported as running away (see `runaway` in the returned stats).
+**/
+lfr_run_stats_t lfr_step_budget(const lfr_budget_t *budget,
+		const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+	assert(budget && vm && graph && state);
+	return lfr_run_(UINT_MAX, true, budget, vm, graph, state);
+}
+
+
+/*
+Step (without checking arguments every step) until out of steps or nothing left to do,
+optionally stopping once idle (see `lfr_run_until_idle()`) or out of budget (see `lfr_step_budget()`).
+*/
+lfr_run_stats_t lfr_run_(unsigned max_steps, bool until_idle, const lfr_budget_t *budget,
+		const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *state) {
+	lfr_run_stats_t stats = {0};
+	lfr_node_queue_t *deferred = &state->deferred_nodes;
+	bool out_of_budget = false;
+
+	// Interpret the graph (like `lfr_step()`)
+	if (state->program) { lfr_bind_program(NULL, state); }
+	lfr_sync_node_state_rows_(&graph->nodes, &state->nodes);
+
+	// Deferred nodes left to take (counted once nothing is scheduled)
+	unsigned deferred_turns = UINT_MAX;
+
+	// Work that is already in flight is never blocked
+	state->stepping = true;
+	while (stats.num_steps < max_steps) {
+		if (lfr_is_out_of_budget_(budget, stats.cost)) {
+			out_of_budget = true;
+			break;
+		}
+
+		// Find the right node
+		// (left over from last budgeted step, then prioritize scheduled over deferred)
+		lfr_node_queue_t *queue = (budget ? lfr_take_carried_lane_(state) : NULL);
+		if (!queue && (queue = lfr_next_scheduled_lane_(state))) {
+			deferred_turns = UINT_MAX;
+		} else if (!queue) {
+			if (deferred_turns == UINT_MAX) { deferred_turns = deferred->num_entries; }
+			if (until_idle && !deferred_turns) { break; }
+			if (!deferred->num_entries) { break; }
+			queue = deferred;
+			deferred_turns--;
+		}
+		lfr_queued_node_t next;
+		lfr_pop_node_queue(queue, &next);
+
+		stats.cost += lfr_step_node_(next, budget, stats.cost, vm, graph, state);
+		stats.num_steps++;
+
+		// Flows that keep going without ever emptying the scheduled lanes are running away
+		if (budget) {
+			if (!lfr_next_scheduled_lane_(state)) {
+				state->busy_steps = 0;
+			} else if (++state->busy_steps >= budget->max_busy_steps && budget->max_busy_steps) {
+				stats.runaway = next.node;
+			}
+		}
+	}
+	state->stepping = false;
+
+	// Whatever did not fit in the budget goes first next time
+	for (unsigned lane = 0; lane <= lfr_no_priorities; lane++) {
+		const lfr_node_queue_t *queue = (lane < lfr_no_priorities ? &state->schedueled_nodes[lane] : deferred);
+		state->num_carried[lane] = (out_of_budget ? queue->num_entries : 0);
+	}
+
+	stats.num_scheduled = lfr_count_scheduled_nodes(state);
+	stats.num_deferred = deferred->num_entries;
+	stats.num_sleeping = state->sleeping_nodes.num_sleeping;
+	stats.num_awaiting = state->awaiting_nodes.num_waiting;
+	return stats;
+}
+
+
+/*
+Check if the given cost (if any) used up the budget, or time ran out.
+*/
+bool lfr_is_out_of_budget_(const lfr_budget_t *budget, unsigned cost) {
+	return budget && ((budget->max_cost && cost >= budget->max_cost)
+		|| (budget->out_of_time && budget->out_of_time(budget->data)));
+}
+
+
+/*
+Scheduled lane to take the next node from (the highest one with any), NULL if nothing is scheduled.
+*/
+lfr_node_queue_t *lfr_next_scheduled_lane_(lfr_graph_state_t *state) {
+	return (lfr_node_queue_t *) lfr_peek_scheduled_nodes(state);
+}
+
+
+/*
+Take the next node to process (prioritize scheduled over deferred), returns false if there is none.
+*/
+bool lfr_pop_next_node_(lfr_graph_state_t *state, lfr_queued_node_t *next) {
+	lfr_node_queue_t *lane = lfr_next_scheduled_lane_(state);
+	return lfr_pop_node_queue(lane ? lane : &state->deferred_nodes, next);
+}
+
+
+/*
+Lane (or deferred queue) of the first node left over by the last budgeted step, NULL if none are left.
+
+The node is counted as taken, so pop it.
+*/
+lfr_node_queue_t *lfr_take_carried_lane_(lfr_graph_state_t *state) {
+	for (unsigned lane = 0; lane <= lfr_no_priorities; lane++) {
+		lfr_node_queue_t *queue = (lane < lfr_no_priorities ? &state->schedueled_nodes[lane] : &state->deferred_nodes);
+		if (state->num_carried[lane] > queue->num_entries) { state->num_carried[lane] = queue->num_entries; }
+		if (state->num_carried[lane]) {
+			state->num_carried[lane]--;
+			return queue;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+Enqueue different nodes depending on processing result.
+*/
+void lfr_follow_result_(lfr_result_e result, lfr_node_id_t node_id, unsigned work,
+		const lfr_graph_t *graph, lfr_graph_state_t *state) {
 	switch(result) {
 	case lfr_continue: {
 		// All clear - Continue flow throgh graph
 		lfr_schedule_node_flow_targets(node_id, graph, state);
 	}break;
 	case lfr_wait: {
-		// Continue processing at a later point
-		lfr_defer_node(node_id, work, graph, state);
+		// Continue processing at a later point (never coalesced)
+		lfr_queued_node_t later = {node_id, work};
+		lfr_push_node_queue_(later, false, &state->deferred_nodes);
+	}
+	case lfr_sleep:
+	case lfr_await: {
+		// Already suspended (see `lfr_process_node_instruction()`)
 	}
 	case lfr_halt: {
 		//Stop flow here - Do nothing
@@ -499,137 +1444,1289 @@ void lfr_step(const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *s
 
 /**
 Process a single node instruction.
+
+Inputs are copied from the values they are bound to in the state
+and outputs are written straight into the state (see `lfr_node_state_t`).
+Nodes that go to sleep (or wait for a signal) are suspended in the state right away.
 **/
 lfr_result_e lfr_process_node_instruction(unsigned instruction, lfr_node_id_t node_id,
 		const lfr_vm_t *vm, const lfr_graph_t *graph, lfr_graph_state_t *state, unsigned *work) {
-	lfr_variant_t input[8] = {0}, output[8] = {0};
+	lfr_variant_t input[lfr_signature_size];
 
 	// Get Input
-	for (int i = 0; i < lfr_signature_size; i++) {
-		input[i] = lfr_get_input_value(node_id, i, vm, graph, state);
+	unsigned state_index = lfr_insert_node_state_at(node_id, vm, &graph->nodes, &state->nodes);
+	lfr_bind_node_state_inputs_(state_index, vm, &graph->nodes, &state->nodes);
+	const lfr_node_state_t *node_state = &state->nodes.node_state[state_index];
+	const unsigned *source = &state->nodes.source[node_state->first_value + node_state->num_outputs];
+	for (unsigned slot = 0; slot < node_state->num_inputs; slot++) {
+		input[slot] = state->nodes.value[source[slot]];
 	}
 
+	// Outputs are replaced by whatever the instruction sets
+	lfr_variant_t *output = &state->nodes.value[node_state->first_value];
+	for (unsigned slot = 0; slot < node_state->num_outputs; slot++) { output[slot] = LFR_NIL; }
+
 	// Process instruction
 	const lfr_instruction_def_t *def = lfr_get_instruction(instruction, vm);
-	lfr_process_env_i env = { node_id, graph, *work, state, state->time, vm->custom_data};
+	lfr_process_env_i env = {
+		node_id, graph, *work, 0, 0, state, state->time, state->clock, lfr_get_custom_data_(vm, state)
+	};
+#ifdef LFR_CHECK_INSTRUCTIONS
+	lfr_instruction_check_t check = lfr_begin_instruction_check_(def, input, &env);
+#endif
 	lfr_result_e result = def->func(input, output, &env);
+#ifdef LFR_CHECK_INSTRUCTIONS
+	lfr_end_instruction_check_(&check, output, result);
+#endif
+	state->nodes.has_run[state_index / 32] |= 1u << state_index % 32;
 
 	// Save work for later
-	if (result == lfr_wait) {
+	if (result == lfr_wait || result == lfr_sleep || result == lfr_await) {
 		*work = env.work;
 	}
-
-	// Update node state with new result data
-	unsigned state_index = lfr_insert_node_state_at(node_id, &graph->nodes, &state->nodes);
-	for (int i = 0; i < lfr_signature_size; i++) {
-		state->nodes.node_state[state_index].output_data[i] = output[i];
-	}
+	lfr_suspend_node_(result, graph->nodes.node[T_INDEX(graph->nodes, node_id)].priority, &env, state);
 
 	return result;
 }
 
 
-//// LFR Graph ////
-
-/**
-Initialize an LFR graph.
-**/
-void lfr_init_graph(lfr_graph_t *graph) {
-	graph->nodes.next_id = 1;
-	graph->num_flow_links = 0;
-	graph->next_node_pos = (lfr_vec2_t) {100,100};
+#ifdef LFR_CHECK_INSTRUCTIONS
+/*
+Take note of what an instruction is about to be processed with (see `lfr_end_instruction_check_()`).
+*/
+lfr_instruction_check_t lfr_begin_instruction_check_(const lfr_instruction_def_t *def,
+		const lfr_variant_t input[], const lfr_process_env_i *env) {
+	lfr_instruction_check_t check = { def, env, .work = env->work };
+	unsigned num_inputs = lfr_count_signature_slots_(def->input_signature);
+	for (unsigned slot = 0; slot < num_inputs; slot++) { check.input[slot] = input[slot]; }
+	check.num_queued = lfr_count_scheduled_nodes(env->graph_state) + lfr_count_deferred_nodes(env->graph_state);
+	return check;
 }
 
 
-/**
-Terminate an LFR graph.
-**/
-void lfr_term_graph(lfr_graph_t *graph) {
+/*
+Assert that a processed instruction did no more than its flags say.
+
+Instructions that do not yield must go on and not request any nodes.
+The ones that do not change anything (or roll dice) are processed again and must give the same output,
+without custom data unless they read the host, and without graph state if they are pure.
+*/
+void lfr_end_instruction_check_(const lfr_instruction_check_t *check, const lfr_variant_t output[],
+		lfr_result_e result) {
+	const lfr_instruction_def_t *def = check->def;
+	const lfr_process_env_i *env = check->env;
+	assert((!(def->flags & lfr_pure) || def->flags == lfr_pure) && "Pure instruction with other flags");
+	if (def->flags & lfr_yields) { return; }
+	assert(result == lfr_continue && "Instruction yields (flag it lfr_yields)");
+	assert(lfr_count_scheduled_nodes(env->graph_state) + lfr_count_deferred_nodes(env->graph_state) == check->num_queued
+		&& "Instruction requests nodes (flag it lfr_yields)");
+	if (def->flags & (lfr_writes_host | lfr_nondeterministic)) { return; }
+
+	// Process again with the same input (and nothing more than the flags allow)
+	lfr_variant_t input[lfr_signature_size], again[lfr_signature_size];
+	memcpy(input, check->input, sizeof(input));
+	unsigned num_outputs = lfr_count_signature_slots_(def->output_signature);
+	for (unsigned slot = 0; slot < num_outputs; slot++) { again[slot] = LFR_NIL; }
+	lfr_process_env_i again_env = {
+		env->node_id, env->graph, check->work, 0, 0,
+		(def->flags & lfr_pure ? NULL : env->graph_state), env->time, env->clock,
+		(def->flags & lfr_reads_host ? env->custom_data : NULL)
+	};
+	lfr_result_e again_result = def->func(input, again, &again_env);
+	assert(again_result == result && "Instruction is nondeterministic (flag it lfr_nondeterministic)");
+	for (unsigned slot = 0; slot < num_outputs; slot++) {
+		assert(lfr_same_variant_(again[slot], output[slot])
+			&& "Instruction is nondeterministic (flag it lfr_nondeterministic)");
+	}
 }
 
 
-/**
-Add a node with the given *core* instruction to the graph.
-
-Node is positioned to the right of the last node in the table.
-**/
-lfr_node_id_t lfr_add_node(lfr_instruction_e inst, lfr_graph_t *graph) {
-	assert(inst < lfr_no_core_instructions);
-	lfr_node_id_t id = lfr_insert_node_into_table(inst, &graph->nodes);
-	graph->nodes.position[graph->nodes.num_rows - 1] = graph->next_node_pos;
-	graph->next_node_pos.x += 310;
-	return id;
+/*
+Check if two variants hold the same value (NaN being the same as NaN).
+*/
+bool lfr_same_variant_(lfr_variant_t a, lfr_variant_t b) {
+	if (lfr_get_variant_type(a) != lfr_get_variant_type(b)) { return false; }
+	switch (lfr_get_variant_type(a)) {
+	case lfr_bool_type: return lfr_to_bool(a) == lfr_to_bool(b);
+	case lfr_int_type: return lfr_to_int(a) == lfr_to_int(b);
+	case lfr_float_type: return lfr_same_float_(lfr_to_float(a), lfr_to_float(b));
+	case lfr_vec2_type: {
+		lfr_vec2_t u = lfr_to_vec2(a), v = lfr_to_vec2(b);
+		return lfr_same_float_(u.x, v.x) && lfr_same_float_(u.y, v.y);
+	}
+	default: return true;
+	}
 }
 
-
-/**
-Add a node with the given *custom* instruction to the graph.
-
-Same layout system as core nodes.
-**/
-lfr_node_id_t lfr_add_custom_node(unsigned inst, lfr_graph_t *graph) {
-	assert(graph);
-	inst += 1 << 8;
-	lfr_node_id_t id = lfr_insert_node_into_table(inst, &graph->nodes);
-	graph->nodes.position[graph->nodes.num_rows - 1] = graph->next_node_pos;
-	graph->next_node_pos.x += 310;
-	return id;
+bool lfr_same_float_(float a, float b) {
+	return a == b || (a != a && b != b);
 }
+#endif
 
 
-/**
-Remove node from graph, including all links to and from it.
-**/
-void lfr_remove_node(lfr_node_id_t id, lfr_graph_t *graph) {
-	assert(graph && T_HAS_ID(graph->nodes, id));
-
-	lfr_disconnect_node(id, graph);
-	lfr_remove_node_from_table(id, &graph->nodes);
+/*
+Bind each input of the node state on the given row to the value it reads (unless already up to date).
+
+Linked inputs read the output of the linked node (which gets a state row if it has none),
+other inputs read their own fixed (or default) value.
+*/
+void lfr_bind_node_state_inputs_(unsigned state_index, const lfr_vm_t *vm, const lfr_node_table_t *nt,
+		lfr_node_state_table_t *st) {
+	if (st->node_state[state_index].revision == nt->revision) { return; }
+
+	// (node state rows are the same as in the node table)
+	lfr_node_id_t id = st->node_state[state_index].node;
+	const unsigned index = state_index;
+	assert(T_SAME_ID(nt->dense_id[index], id));
+	for (unsigned slot = 0; slot < nt->node[index].num_inputs; slot++) {
+		// Make sure linked node has a row first (inserting may move the value pool)
+		lfr_slot_ref_t link = nt->slot[lfr_input_slot_(index, slot, nt)].link;
+		bool linked = T_IS_LIVE(*nt, link.node);
+		unsigned linked_index = (linked ? lfr_insert_node_state_at(link.node, vm, nt, st) : 0);
+
+		const lfr_node_state_t *node_state = &st->node_state[state_index];
+		unsigned input = node_state->first_value + node_state->num_outputs + slot;
+		st->value[input] = lfr_get_fixed_input_value(id, slot, vm, nt);
+		if (linked) {
+			assert(link.slot < st->node_state[linked_index].num_outputs);
+			st->source[input] = st->node_state[linked_index].first_value + link.slot;
+		} else {
+			st->source[input] = input;
+		}
+	}
+	st->node_state[state_index].revision = nt->revision;
 }
 
 
+//// LFR Compiled programs ////
+
 /**
-Link execution of one node to another.
+Compile graph into a program that does the same thing as `lfr_step()` on the graph, only faster.
+
+All links, defaults and instructions are resolved up front.
+Nodes with pure instructions (see `lfr_instruction_flag_e`) whose inputs are all fixed
+(or come from other such nodes) are evaluated once, right here,
+and left out of the flow (their flow targets are requested in their place).
+This pays off for graphs that are edited rarely and executed often.
+The graph and vm must be kept (unchanged) as long as the program is in use.
+Release the program with `lfr_term_program()`.
 **/
-void lfr_link_nodes(lfr_node_id_t source_node, lfr_node_id_t target_node, lfr_graph_t *graph) {
-	assert(graph->num_flow_links < lfr_graph_max_flow_links);
-
-	// Prevent duplicates
-	if (lfr_has_link(source_node, target_node, graph)) { return; };
+lfr_program_t lfr_compile_graph(const lfr_vm_t *vm, const lfr_graph_t *graph) {
+	assert(vm && graph);
+	const lfr_node_table_t *nodes = &graph->nodes;
+#ifdef LFR_THREADS
+	static atomic_uint num_compiled = 0;
+	lfr_program_t program = { .vm = vm, .graph = graph, .serial = atomic_fetch_add(&num_compiled, 1) + 1 };
+#else
+	static unsigned num_compiled = 0;
+	lfr_program_t program = { .vm = vm, .graph = graph, .serial = ++num_compiled };
+#endif
 
-	// Add (non-duplicate link)
-	graph->flow_links[graph->num_flow_links++] = (lfr_flow_link_t) {source_node, target_node};
-}
+	// Room for operations
+	program.num_ops = nodes->num_rows;
+	program.id_range = nodes->id_range;
+	T_RESIZE_COLUMN(program.ops, program.num_ops);
+	T_RESIZE_COLUMN(program.op_index, program.id_range);
+	for (unsigned id = 0; id < program.id_range; id++) { program.op_index[id] = UINT_MAX; }
+
+	// Map node ids to operations and lay out values first (data links may point to any node)
+	unsigned num_outputs = 0;
+	T_FOR_ROWS(index, *nodes) {
+		const lfr_node_t *node = &nodes->node[index];
+		lfr_program_op_t *op = &program.ops[index];
+		program.op_index[T_ID(*nodes, index).id] = index;
+		op->folded = false;
+		op->first_input = program.num_inputs;
+		op->output = num_outputs;
+		op->num_inputs = node->num_inputs;
+		op->num_outputs = node->num_outputs;
+		op->priority = node->priority;
+		op->every_event = lfr_get_instruction(node->instruction, vm)->every_event;
+		program.num_inputs += node->num_inputs;
+		num_outputs += node->num_outputs;
+	}
 
+	// Room for values
+	program.num_values = num_outputs + program.num_inputs;
+	T_RESIZE_COLUMN(program.inputs, program.num_inputs);
+	T_RESIZE_COLUMN(program.values, program.num_values);
+
+	const unsigned first_fixed = num_outputs;
+	T_FOR_ROWS(index, *nodes) {
+		lfr_node_id_t id = T_ID(*nodes, index);
+		const lfr_node_t *node = &nodes->node[index];
+		lfr_program_op_t *op = &program.ops[index];
+		op->node_id = id;
+		op->func = lfr_get_instruction(node->instruction, vm)->func;
+
+		// Outputs start out as defaults
+		for (unsigned slot = 0; slot < op->num_outputs; slot++) {
+			program.values[op->output + slot] = lfr_get_default_output_value(id, slot, vm, nodes);
+		}
 
-/**
-Is there a linke from one node to the other?
+		// Inputs read linked output, or fixed value if not linked
+		for (unsigned slot = 0; slot < op->num_inputs; slot++) {
+			lfr_slot_ref_t link = nodes->slot[lfr_input_slot_(index, slot, nodes)].link;
+			unsigned fixed = first_fixed + op->first_input + slot;
+			program.values[fixed] = lfr_get_fixed_input_value(id, slot, vm, nodes);
+			if (T_IS_LIVE(*nodes, link.node)) {
+				unsigned out_index = T_INDEX(*nodes, link.node);
+				program.inputs[op->first_input + slot] = program.ops[out_index].output + link.slot;
+			} else {
+				program.inputs[op->first_input + slot] = fixed;
+			}
+		}
+	}
+
+	// Evaluate what is constant once and for all
+	lfr_fold_program_constants_(&program);
+
+	// Flow targets (skipping folded ops)
+	unsigned max_targets = 0;
+	T_FOR_ROWS(index, *nodes) {
+		const lfr_node_id_t *targets;
+		lfr_program_op_t *op = &program.ops[index];
+		unsigned num_targets = lfr_get_node_flow_targets(op->node_id, graph, &targets);
+		op->first_target = program.num_targets;
+		for (unsigned i = 0; i < num_targets; i++) {
+			lfr_add_program_target_(targets[i], &max_targets, &program);
+		}
+		op->num_targets = program.num_targets - op->first_target;
+	}
+
+	return program;
+}
+
+
+/*
+Fold ops of pure instructions with only fixed inputs (or inputs from other folded ops).
+
+The results become the initial output values of the ops, which are never processed.
+Instructions are called without graph state (pure ones have no use for it).
+*/
+void lfr_fold_program_constants_(lfr_program_t *program) {
+	const lfr_node_table_t *nodes = &program->graph->nodes;
+
+	// Ops are not in flow order, so go again until nothing more folds
+	for (bool again = true; again;) {
+		again = false;
+		T_FOR_ROWS(index, *nodes) {
+			lfr_program_op_t *op = &program->ops[index];
+			const lfr_node_t *node = &nodes->node[index];
+			if (op->folded || !(lfr_get_instruction(node->instruction, program->vm)->flags & lfr_pure)) { continue; }
+
+			// All inputs must be known by now
+			bool constant = true;
+			for (unsigned slot = 0; slot < op->num_inputs; slot++) {
+				lfr_slot_ref_t link = nodes->slot[lfr_input_slot_(index, slot, nodes)].link;
+				if (T_IS_LIVE(*nodes, link.node) && !program->ops[T_INDEX(*nodes, link.node)].folded) {
+					constant = false;
+				}
+			}
+			if (!constant) { continue; }
+
+			// Evaluate (keeping defaults unless the instruction goes on as usual)
+			lfr_variant_t input[lfr_signature_size], output[lfr_signature_size];
+			for (unsigned slot = 0; slot < op->num_inputs; slot++) {
+				input[slot] = program->values[program->inputs[op->first_input + slot]];
+			}
+			for (unsigned slot = 0; slot < op->num_outputs; slot++) { output[slot] = LFR_NIL; }
+			lfr_process_env_i env = {
+				op->node_id, program->graph, 0, 0, 0, NULL, 0.f, 0, program->vm->custom_data
+			};
+			if (op->func(input, output, &env) != lfr_continue) { continue; }
+			for (unsigned slot = 0; slot < op->num_outputs; slot++) {
+				program->values[op->output + slot] = output[slot];
+			}
+			op->folded = true;
+			program->num_folded++;
+			again = true;
+		}
+	}
+}
+
+
+/*
+Add flow target to the program, or the targets of the target if it is folded.
+
+A folded op is marked as unfolded while its targets are added,
+so flow loops of folded ops end up requesting the (folded) op itself, just like before.
+*/
+void lfr_add_program_target_(lfr_node_id_t target, unsigned *max_targets, lfr_program_t *program) {
+	lfr_program_op_t *op = &program->ops[program->op_index[target.id]];
+	if (op->folded) {
+		const lfr_node_id_t *targets;
+		unsigned num_targets = lfr_get_node_flow_targets(target, program->graph, &targets);
+		op->folded = false;
+		for (unsigned i = 0; i < num_targets; i++) {
+			lfr_add_program_target_(targets[i], max_targets, program);
+		}
+		op->folded = true;
+		return;
+	}
+
+	if (program->num_targets == *max_targets) {
+		*max_targets = lfr_grow_capacity_(*max_targets, program->num_targets + 1);
+		T_RESIZE_COLUMN(program->targets, *max_targets);
+	}
+	program->targets[program->num_targets++] = target;
+}
+
+
+/**
+Release all memory held by the program.
+
+Graph states the program is bound to must be unbound (see `lfr_bind_program()`) before they are used again.
 **/
-bool lfr_has_link(lfr_node_id_t source_node, lfr_node_id_t target_node, const lfr_graph_t *graph) {
-	for (int i = 0; i < graph->num_flow_links; i++) {
-		const lfr_flow_link_t *link = &graph->flow_links[i];
-		if ( !T_SAME_ID(source_node, link->source_node)) { continue; }
-		if ( !T_SAME_ID(target_node, link->target_node)) { continue; }
+void lfr_term_program(lfr_program_t *program) {
+	assert(program);
+	free(program->ops);
+	free(program->op_index);
+	free(program->inputs);
+	free(program->targets);
+	free(program->values);
+	*program = (lfr_program_t) {0};
+}
+
+
+/**
+Prepare graph state for running the given program (NULL to stop running programs).
+
+Output values are carried over from the state (when available),
+so switching from `lfr_step()` to `lfr_step_program()` is seamless.
+Unbinding (or binding another program) copies outputs of the ops that have run back into the state.
+Stepping with `lfr_step()` (or any of the other interpreting steps) unbinds the program by itself.
+Outputs of a program that has since been compiled again at the same address are lost.
+Queued nodes are kept as they are.
+
+Binding happens automatically in `lfr_step_program()` when a state is used with a new program
+(or a program compiled again at the same address).
+**/
+void lfr_bind_program(const lfr_program_t *program, lfr_graph_state_t *state) {
+	assert(state);
+
+	// Keep what the old program did
+	const lfr_program_t *bound = lfr_get_bound_program_(state);
+	if (bound) { lfr_write_back_program_values_(bound, state); }
+
+	state->program = NULL;
+	state->num_program_values = (program ? program->num_values : 0);
+	T_RESIZE_COLUMN(state->program_values, state->num_program_values);
+	unsigned num_bit_words = (program ? (program->num_ops + 31) / 32 : 0);
+	T_RESIZE_COLUMN(state->program_has_run, num_bit_words);
+	if (num_bit_words) { memset(state->program_has_run, 0, sizeof(unsigned) * num_bit_words); }
+	if (!program) { return; }
+
+	// Start from defaults (and folded constants), then take outputs that are already in state
+	// (with rows caught up first, so that each of them is found right away)
+	lfr_sync_node_state_rows_(&program->graph->nodes, &state->nodes);
+	memcpy(state->program_values, program->values, sizeof(lfr_variant_t) * program->num_values);
+	for (unsigned op = 0; op < program->num_ops; op++) {
+		lfr_node_id_t id = program->ops[op].node_id;
+		unsigned row = lfr_find_node_state_(id, &program->graph->nodes, &state->nodes);
+		if (row == UINT_MAX || program->ops[op].folded) { continue; }
+		const lfr_node_state_t *node_state = &state->nodes.node_state[row];
+		for (unsigned slot = 0; slot < program->ops[op].num_outputs; slot++) {
+			state->program_values[program->ops[op].output + slot] =
+				state->nodes.value[node_state->first_value + slot];
+		}
+	}
+	state->program = program;
+	state->program_serial = program->serial;
+}
+
+
+/*
+Copy outputs of the ops that have run since the program was bound into the node states.
+*/
+void lfr_write_back_program_values_(const lfr_program_t *program, lfr_graph_state_t *state) {
+	const lfr_node_table_t *nodes = &program->graph->nodes;
+	for (unsigned op = 0; op < program->num_ops; op++) {
+		if (!(state->program_has_run[op / 32] & (1u << op % 32))) { continue; }
+		const lfr_program_op_t *done = &program->ops[op];
+		unsigned row = lfr_insert_node_state_at(done->node_id, program->vm, nodes, &state->nodes);
+		state->nodes.has_run[row / 32] |= 1u << row % 32;
+		lfr_variant_t *output = &state->nodes.value[state->nodes.node_state[row].first_value];
+		for (unsigned slot = 0; slot < done->num_outputs; slot++) {
+			output[slot] = state->program_values[done->output + slot];
+		}
+	}
+}
+
+
+/**
+Execute topmost scheduled node (if any), just like `lfr_step()` but using a compiled program.
+
+Nodes are scheduled and deferred as usual (with the graph the program was compiled from).
+Results are kept in the value array of the state (read them with `lfr_get_output_value()`).
+
+Unlike `lfr_step()`, nodes folded by `lfr_compile_graph()` have their results as soon as the program is bound,
+so reading them (or inputs linked to them) gives the folded value before the node would have run,
+where `lfr_step()` would still give the default output value.
+Folded nodes are never processed, so they are not written back when unbinding.
+**/
+void lfr_step_program(const lfr_program_t *program, lfr_graph_state_t *state) {
+	assert(program && state);
+	if (lfr_get_bound_program_(state) != program) {
+		lfr_bind_program(program, state);
+	}
+
+	// Find the right node
+	// (prioritize scheduled over deferred)
+	lfr_queued_node_t next;
+	if (!lfr_pop_next_node_(state, &next)) {
+		// Nothing to do
+		return;
+	}
+
+	// Skip node not in program
+	unsigned op_index = lfr_find_program_op_(next.node, program);
+	if (op_index == UINT_MAX) { return; }
+	const lfr_program_op_t *op = &program->ops[op_index];
+
+	// Work that is already in flight is never blocked
+	state->stepping = true;
+
+	for (unsigned depth = 0;; depth++) {
+		// Process instruction (folded ones already have their outputs and just go on)
+		lfr_process_env_i env = {
+			op->node_id, program->graph, next.work, 0, 0, state, state->time, state->clock,
+			lfr_get_custom_data_(program->vm, state)
+		};
+		lfr_result_e result = lfr_continue;
+		if (!op->folded) {
+			lfr_variant_t input[lfr_signature_size];
+			lfr_variant_t *values = state->program_values, *output = &values[op->output];
+			const unsigned *inputs = &program->inputs[op->first_input];
+			for (unsigned slot = 0; slot < op->num_inputs; slot++) { input[slot] = values[inputs[slot]]; }
+			for (unsigned slot = 0; slot < op->num_outputs; slot++) { output[slot] = LFR_NIL; }
+#ifdef LFR_CHECK_INSTRUCTIONS
+			const lfr_node_t *node = &program->graph->nodes.node[op - program->ops];
+			lfr_instruction_check_t check = lfr_begin_instruction_check_(
+				lfr_get_instruction(node->instruction, program->vm), input, &env);
+#endif
+			result = op->func(input, output, &env);
+#ifdef LFR_CHECK_INSTRUCTIONS
+			lfr_end_instruction_check_(&check, output, result);
+#endif
+			unsigned op_index = op - program->ops;
+			state->program_has_run[op_index / 32] |= 1u << op_index % 32;
+		}
+
+		// Follow single target right away (see `lfr_set_direct_flow()`)
+		if (result == lfr_continue && op->num_targets == 1 && depth < state->max_direct_depth) {
+			lfr_node_id_t target = program->targets[op->first_target];
+			const lfr_program_op_t *target_op = &program->ops[program->op_index[target.id]];
+			if (lfr_may_run_directly_(target, target_op->priority, target_op->every_event, state)) {
+				next = (lfr_queued_node_t) {target, 0};
+				op = target_op;
+				continue;
+			}
+		}
+
+		// Enqueue different nodes depending on processing result
+		switch(result) {
+		case lfr_continue: {
+			for (unsigned i = 0; i < op->num_targets; i++) {
+				lfr_queued_node_t target = {program->targets[op->first_target + i], 0};
+				const lfr_program_op_t *target_op = &program->ops[program->op_index[target.node.id]];
+				lfr_push_request_(target, target_op->priority, target_op->every_event, state);
+			}
+		} break;
+		case lfr_wait: {
+			lfr_queued_node_t later = {op->node_id, env.work};
+			lfr_push_node_queue_(later, false, &state->deferred_nodes);
+		} break;
+		case lfr_sleep:
+		case lfr_await: {
+			lfr_suspend_node_(result, op->priority, &env, state);
+		} break;
+		case lfr_halt: break;
+		case lfr_no_results: { assert(0); } break;
+		}
+		break;
+	}
+
+	state->stepping = false;
+}
+
+
+/*
+Get host context to pass to instructions (the one of the state has priority over the one of the vm).
+*/
+void* lfr_get_custom_data_(const lfr_vm_t *vm, const lfr_graph_state_t *state) {
+	return (state->custom_data ? state->custom_data : vm->custom_data);
+}
+
+
+/*
+Random float in [0, 1] (xorshift, advancing the given random state).
+*/
+float lfr_random_float_(unsigned *random_state) {
+	unsigned x = (*random_state ? *random_state : 2463534242u);
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*random_state = x;
+	return (float) (x >> 8) / (float) (UINT_MAX >> 8);
+}
+
+
+/*
+Get the program the state is bound to (NULL if none, or if it has been compiled again since).
+*/
+const lfr_program_t *lfr_get_bound_program_(const lfr_graph_state_t *state) {
+	const lfr_program_t *program = state->program;
+	return (program && program->serial == state->program_serial ? program : NULL);
+}
+
+
+/*
+Get the operation of the given node (UINT_MAX if the node is not in the program).
+*/
+unsigned lfr_find_program_op_(lfr_node_id_t id, const lfr_program_t *program) {
+	if (id.id >= program->id_range) { return UINT_MAX; }
+	unsigned op = program->op_index[id.id];
+	if (op == UINT_MAX || !T_SAME_ID(program->ops[op].node_id, id)) { return UINT_MAX; }
+	return op;
+}
+
+
+//// LFR World ////
+
+/**
+Initialize an (empty) world running the given graph.
+
+Pass a program compiled from the graph to run it instead of interpreting the graph (or NULL).
+Graph, vm and program must outlive the world and must not change while it is in use.
+**/
+void lfr_init_world(const lfr_vm_t *vm, const lfr_graph_t *graph, const lfr_program_t *program,
+		lfr_world_t *world) {
+	assert(vm && graph && world);
+	assert(!program || program->graph == graph);
+	*world = (lfr_world_t) { .vm = vm, .graph = graph, .program = program };
+	lfr_detect_simd_level_();
+}
+
+
+/**
+Terminate world.
+
+Releases all memory owned by the world (including instance states).
+**/
+void lfr_term_world(lfr_world_t *world) {
+	assert(world);
+	for (unsigned i = 0; i < world->num_instances; i++) {
+		lfr_term_graph_state(&world->instances[i].state);
+	}
+	free(world->instances);
+	free(world->active);
+	free(world->batch.entries);
+	free(world->batch.order);
+	free(world->batch.steps);
+	free(world->batch.busy);
+	free(world->batch.row);
+	free(world->batch.group_start);
+	free(world->batch.columns);
+	free(world->batch.env);
+	free(world->batch.result);
+	*world = (lfr_world_t) {0};
+}
+
+
+/**
+Add an (idle) instance to the world, returning the instance number.
+
+The custom data is passed to instructions processed for this instance (instead of the one in vm).
+Instance numbers are never reused, but pointers to instance states change when instances are added.
+**/
+unsigned lfr_add_world_instance(void *custom_data, lfr_world_t *world) {
+	assert(world);
+	if (world->num_instances == world->max_instances) {
+		world->max_instances = lfr_grow_capacity_(world->max_instances, world->num_instances + 1);
+		T_RESIZE_COLUMN(world->instances, world->max_instances);
+		T_RESIZE_COLUMN(world->active, world->max_instances);
+	}
+
+	unsigned instance = world->num_instances++;
+	world->instances[instance] = (lfr_world_instance_t) {0};
+	lfr_init_graph_state(&world->instances[instance].state);
+	world->instances[instance].state.custom_data = custom_data;
+	return instance;
+}
+
+
+/**
+Get the graph state of an instance.
+
+Nodes can be scheduled or deferred directly in the state,
+but the instance must then be woken up (see `lfr_wake_world_instance()`) to be stepped.
+**/
+lfr_graph_state_t* lfr_get_world_instance_state(unsigned instance, lfr_world_t *world) {
+	assert(world && instance < world->num_instances);
+	return &world->instances[instance].state;
+}
+
+
+/**
+Add an instance to the active set (if not already in it).
+**/
+void lfr_wake_world_instance(unsigned instance, lfr_world_t *world) {
+	assert(world && instance < world->num_instances);
+	if (world->instances[instance].active) { return; }
+	world->instances[instance].active = true;
+	world->active[world->num_active++] = instance;
+}
+
+
+/**
+Schedule all nodes with the given instruction in a single instance (see `lfr_schedule_instruction()`).
+**/
+unsigned lfr_schedule_world_instruction(unsigned instruction, unsigned instance, lfr_world_t *world) {
+	assert(world && instance < world->num_instances);
+	unsigned count = lfr_schedule_instruction(instruction, world->graph, &world->instances[instance].state);
+	if (count) { lfr_wake_world_instance(instance, world); }
+	return count;
+}
+
+
+/**
+Defer all nodes with the given instruction in a single instance (see `lfr_defer_instruction()`).
+
+This is the way to trigger events for a single entity.
+**/
+unsigned lfr_defer_world_instruction(unsigned instruction, unsigned work, unsigned instance, lfr_world_t *world) {
+	assert(world && instance < world->num_instances);
+	unsigned count = lfr_defer_instruction(instruction, work, world->graph, &world->instances[instance].state);
+	if (count) { lfr_wake_world_instance(instance, world); }
+	return count;
+}
+
+
+/**
+Schedule all nodes with the given instruction in every instance (like `lfr_tick`).
+
+Returns the total number of nodes scheduled.
+**/
+unsigned lfr_broadcast_world_instruction(unsigned instruction, lfr_world_t *world) {
+	assert(world);
+
+	// Cheap way out for graphs without the instruction
+	const lfr_node_id_t *nodes;
+	if (!lfr_get_nodes_with_instruction(instruction, &world->graph->nodes, &nodes)) { return 0; }
+
+	unsigned count = 0;
+	for (unsigned i = 0; i < world->num_instances; i++) {
+		count += lfr_schedule_world_instruction(instruction, i, world);
+	}
+	return count;
+}
+
+
+/**
+Raise signal in a single instance (see `lfr_raise_signal()`).
+
+Returns the number of nodes woken up.
+**/
+unsigned lfr_raise_world_signal(unsigned signal, unsigned instance, lfr_world_t *world) {
+	assert(world && instance < world->num_instances);
+	unsigned count = lfr_raise_signal(signal, &world->instances[instance].state);
+	if (count) { lfr_wake_world_instance(instance, world); }
+	return count;
+}
+
+
+/**
+Raise signal in every instance.
+
+Returns the total number of nodes woken up.
+**/
+unsigned lfr_broadcast_world_signal(unsigned signal, lfr_world_t *world) {
+	assert(world);
+	unsigned count = 0;
+	for (unsigned i = 0; i < world->num_instances; i++) {
+		count += lfr_raise_world_signal(signal, i, world);
+	}
+	return count;
+}
+
+
+/**
+Forward the time of the world by the given amount.
+
+Instance states get the world time when stepped (idle instances keep the time they were last stepped at).
+**/
+void lfr_forward_world_time(float dt, lfr_world_t *world) {
+	assert(world);
+	lfr_forward_world_clock(lfr_seconds_to_clock_(dt), world);
+}
+
+
+/**
+Same as `lfr_forward_world_time()`, but in microseconds.
+**/
+void lfr_forward_world_clock(lfr_time_t dt, lfr_world_t *world) {
+	assert(world);
+	world->clock += dt;
+	world->time = lfr_clock_to_seconds_(world->clock);
+}
+
+
+/**
+Step every active instance (at most) the given number of times.
+
+Instances that run out of queued nodes leave the active set.
+Returns the total number of steps taken.
+**/
+unsigned lfr_step_world(unsigned max_steps, lfr_world_t *world) {
+	assert(world);
+	unsigned num_steps = 0;
+
+	for (unsigned a = 0; a < world->num_active; a++) {
+		lfr_graph_state_t *state = &world->instances[world->active[a]].state;
+		lfr_set_state_clock_(world->clock, state);
+		num_steps += lfr_step_state_(max_steps, world->vm, world->graph, world->program, state);
+	}
+
+	lfr_drop_idle_world_instances_(world);
+	return num_steps;
+}
+
+
+/*
+Step state until done (or out of steps), returning the number of steps taken.
+*/
+unsigned lfr_step_state_(unsigned max_steps, const lfr_vm_t *vm, const lfr_graph_t *graph,
+		const lfr_program_t *program, lfr_graph_state_t *state) {
+	if (!program) {
+		return lfr_run_(max_steps, false, NULL, vm, graph, state).num_steps;
+	}
+
+	unsigned num_steps = 0;
+	while (num_steps < max_steps && (lfr_count_scheduled_nodes(state) || lfr_count_deferred_nodes(state))) {
+		lfr_step_program(program, state);
+		num_steps++;
+	}
+	return num_steps;
+}
+
+
+/*
+Remove instances that have run out of queued (and sleeping) nodes from the active set.
+*/
+void lfr_drop_idle_world_instances_(lfr_world_t *world) {
+	for (unsigned a = 0; a < world->num_active;) {
+		lfr_world_instance_t *instance = &world->instances[world->active[a]];
+		if (lfr_count_scheduled_nodes(&instance->state) || lfr_count_deferred_nodes(&instance->state)
+			|| lfr_count_sleeping_nodes(&instance->state)) {
+			a++;
+			continue;
+		}
+
+		// Move last active into its place
+		instance->active = false;
+		world->active[a] = world->active[--world->num_active];
+	}
+}
+
+
+/**
+Same as `lfr_step_world()`, but processing the same graph node in different instances together.
+
+Each active instance steps (just like `lfr_step()`) until its next node has a batched instruction.
+These nodes are then grouped by graph node and each group is processed in one call to
+the `batch_func` of the instruction. This repeats until all instances are idle or out of steps.
+Instances progress exactly as they would with `lfr_step_world()` in a world without a program,
+as long as they do not use direct flow. Otherwise `lfr_step_world()` does the same work in fewer steps
+(folded nodes and nodes followed right away are not counted), so it may get further within `max_steps`.
+
+Batching is not faster by itself. Every instance still pops, binds and schedules its own nodes,
+so that bookkeeping is the same as with `lfr_step_world()` and grouping comes on top of it
+(cheap instructions like the core math ones end up a bit slower than stepping one instance at a time).
+It pays off when a `batch_func` saves more per node than that, like one host call for a whole batch.
+
+Note: Batching interprets the graph (instances bound to a compiled program are unbound),
+does not process flow targets right away (see `lfr_set_direct_flow()`)
+and does not check batched instructions (see `lfr_instruction_flag_e`).
+**/
+enum { lfr_batch_tile_size_ = 256 };
+unsigned lfr_step_world_batched(unsigned max_steps, lfr_world_t *world) {
+	assert(world);
+	const lfr_node_table_t *nodes = &world->graph->nodes;
+	unsigned num_steps = 0;
+
+	// Make room for one entry per active instance and one group per node
+	if (world->batch.max_entries < world->num_active) {
+		world->batch.max_entries = lfr_grow_capacity_(world->batch.max_entries, world->num_active);
+		T_RESIZE_COLUMN(world->batch.entries, world->batch.max_entries);
+		T_RESIZE_COLUMN(world->batch.order, world->batch.max_entries);
+		T_RESIZE_COLUMN(world->batch.steps, world->batch.max_entries);
+		T_RESIZE_COLUMN(world->batch.busy, world->batch.max_entries);
+		T_RESIZE_COLUMN(world->batch.row, world->batch.max_entries);
+		T_RESIZE_COLUMN(world->batch.env, world->batch.max_entries);
+		T_RESIZE_COLUMN(world->batch.result, world->batch.max_entries);
+	}
+	if (world->batch.max_groups < nodes->num_rows + 1) {
+		world->batch.max_groups = lfr_grow_capacity_(world->batch.max_groups, nodes->num_rows + 1);
+		T_RESIZE_COLUMN(world->batch.group_start, world->batch.max_groups);
+	}
+
+	// Every active instance takes part (interpreting the graph, at the time of the world)
+	for (unsigned a = 0; a < world->num_active; a++) {
+		lfr_graph_state_t *state = &world->instances[world->active[a]].state;
+		if (state->program) { lfr_bind_program(NULL, state); }
+		lfr_set_state_clock_(world->clock, state);
+		world->batch.steps[a] = 0;
+	}
+
+	// Take instances a tile at a time (so that their states stay in cache from one round to the next)
+	for (unsigned tile = 0; tile < world->num_active; tile += lfr_batch_tile_size_) {
+		unsigned num_busy = 0;
+		for (unsigned a = tile; a < world->num_active && a < tile + lfr_batch_tile_size_; a++) {
+			if (lfr_step_to_batched_node_(a, max_steps, world)) { world->batch.busy[num_busy++] = a; }
+		}
+
+		while (num_busy) {
+			// Group busy instances by the node they are at (counting sort on node index)
+			unsigned *group_start = world->batch.group_start;
+			for (unsigned g = 0; g <= nodes->num_rows; g++) { group_start[g] = 0; }
+			for (unsigned b = 0; b < num_busy; b++) {
+				group_start[T_INDEX(*nodes, world->batch.entries[world->batch.busy[b]].node) + 1]++;
+			}
+			for (unsigned g = 0; g < nodes->num_rows; g++) { group_start[g + 1] += group_start[g]; }
+			for (unsigned b = 0; b < num_busy; b++) {
+				unsigned a = world->batch.busy[b];
+				world->batch.order[group_start[T_INDEX(*nodes, world->batch.entries[a].node)]++] = a;
+			}
+
+			// Process groups (group starts have been moved to where the next group starts),
+			// which steps the instances on to their next batched nodes
+			unsigned first = 0;
+			num_busy = 0;
+			for (unsigned g = 0; g < nodes->num_rows; g++) {
+				if (group_start[g] == first) { continue; }
+				lfr_process_batch_(first, group_start[g] - first, max_steps, &num_busy, world);
+				first = group_start[g];
+			}
+		}
+	}
+	for (unsigned a = 0; a < world->num_active; a++) { num_steps += world->batch.steps[a]; }
+
+	lfr_drop_idle_world_instances_(world);
+	return num_steps;
+}
+
+
+/*
+Step an active instance (see `lfr_step_world_batched()`) until its next node has a batched instruction,
+leaving that node as its batch entry. Returns false if it ran out of steps or nodes first.
+*/
+bool lfr_step_to_batched_node_(unsigned a, unsigned max_steps, lfr_world_t *world) {
+	const lfr_node_table_t *nodes = &world->graph->nodes;
+	lfr_graph_state_t *state = &world->instances[world->active[a]].state;
+
+	lfr_queued_node_t next;
+	while (world->batch.steps[a] < max_steps && lfr_pop_next_node_(state, &next)) {
+		world->batch.steps[a]++;
+
+		// Skip node no longer in graph
+		if (!T_IS_LIVE(*nodes, next.node)) { continue; }
+
+		// Leave batched nodes for later
+		unsigned instruction = nodes->node[T_INDEX(*nodes, next.node)].instruction;
+		if (lfr_get_instruction(instruction, world->vm)->batch_func) {
+			world->batch.entries[a] = next;
+			return true;
+		}
+
+		// Process others right away
+		unsigned work = next.work;
+		state->stepping = true;
+		lfr_result_e result = lfr_process_node_instruction(instruction, next.node, world->vm, world->graph, state, &work);
+		lfr_follow_result_(result, next.node, work, world->graph, state);
+		state->stepping = false;
+	}
+	return false;
+}
+
+
+/*
+Process a group of active instances (ordered by group) that are all at the same batched node,
+then step each of them on to its next batched node (adding the ones that get there to the busy list).
+*/
+void lfr_process_batch_(unsigned first, unsigned size, unsigned max_steps, unsigned *num_busy, lfr_world_t *world) {
+	const lfr_graph_t *graph = world->graph;
+	const unsigned *order = &world->batch.order[first];
+	const lfr_node_id_t node_id = world->batch.entries[order[0]].node;
+	const unsigned index = T_INDEX(graph->nodes, node_id);
+	const lfr_node_t *node = &graph->nodes.node[index];
+	const lfr_instruction_def_t *def = lfr_get_instruction(node->instruction, world->vm);
+
+	assert(def->batch_func);
+
+	// Make room for one column per slot
+	unsigned num_column_values = (node->num_inputs + node->num_outputs) * size;
+	if (world->batch.max_column_values < num_column_values) {
+		world->batch.max_column_values = lfr_grow_capacity_(world->batch.max_column_values, num_column_values);
+		T_RESIZE_COLUMN(world->batch.columns, world->batch.max_column_values);
+	}
+
+	// Set up columns (inputs first, then outputs)
+	lfr_batch_t batch = { size, .env = world->batch.env, .result = world->batch.result };
+	for (unsigned slot = 0; slot < node->num_inputs; slot++) {
+		batch.input[slot] = &world->batch.columns[slot * size];
+	}
+	for (unsigned slot = 0; slot < node->num_outputs; slot++) {
+		batch.output[slot] = &world->batch.columns[(node->num_inputs + slot) * size];
+		memset(batch.output[slot], 0, sizeof(lfr_variant_t) * size);
+	}
+
+	// Gather input from the values each state has bound the inputs to (like `lfr_process_node_instruction()`),
+	// and set up envs (they have const fields, so they are copied into place)
+	for (unsigned k = 0; k < size; k++) {
+		lfr_graph_state_t *state = &world->instances[world->active[order[k]]].state;
+		lfr_node_state_table_t *st = &state->nodes;
+		unsigned state_index = lfr_insert_node_state_at(node_id, world->vm, &graph->nodes, st);
+		lfr_bind_node_state_inputs_(state_index, world->vm, &graph->nodes, st);
+		const lfr_node_state_t *node_state = &st->node_state[state_index];
+		const unsigned *source = &st->source[node_state->first_value + node_state->num_outputs];
+		for (unsigned slot = 0; slot < node->num_inputs; slot++) {
+			world->batch.columns[slot * size + k] = st->value[source[slot]];
+		}
+		world->batch.row[k] = state_index;
+
+		lfr_process_env_i env = {
+			node_id, graph, world->batch.entries[order[k]].work, 0, 0, state, state->time, state->clock,
+			lfr_get_custom_data_(world->vm, state)
+		};
+		memcpy(&batch.env[k], &env, sizeof(env));
+	}
+
+	// Process all at once
+	def->batch_func(&batch);
+
+	// Scatter output and follow results
+	// (flow targets are the same for the whole batch, as batching interprets the graph)
+	const lfr_node_id_t *targets;
+	unsigned num_targets = lfr_get_node_flow_targets(node_id, graph, &targets);
+	for (unsigned k = 0; k < size; k++) {
+		lfr_graph_state_t *state = batch.env[k].graph_state;
+		unsigned state_index = world->batch.row[k]; // (rows stay put until the node table changes)
+		state->nodes.has_run[state_index / 32] |= 1u << state_index % 32;
+		lfr_variant_t *output = &state->nodes.value[state->nodes.node_state[state_index].first_value];
+		for (unsigned slot = 0; slot < node->num_outputs; slot++) {
+			output[slot] = batch.output[slot][k];
+		}
+		state->stepping = true;
+		if (batch.result[k] == lfr_continue) {
+			for (unsigned i = 0; i < num_targets; i++) {
+				lfr_queued_node_t entry = {targets[i], 0};
+				unsigned lane = graph->nodes.node[T_INDEX(graph->nodes, targets[i])].priority;
+				lfr_push_request_(entry, lane, lfr_sees_every_event_(targets[i], graph, state), state);
+			}
+		} else {
+			lfr_suspend_node_(batch.result[k], node->priority, &batch.env[k], state);
+			lfr_follow_result_(batch.result[k], node_id, batch.env[k].work, graph, state);
+		}
+		state->stepping = false;
+
+		// Go on while the state is at hand
+		if (lfr_step_to_batched_node_(order[k], max_steps, world)) { world->batch.busy[(*num_busy)++] = order[k]; }
+	}
+}
+
+
+//// LFR Worker pool ////
+#ifdef LFR_THREADS
+
+/* Work through own share, then steal from the other workers (returns when no items are left). */
+void lfr_work_(lfr_worker_t *worker) {
+	lfr_worker_pool_t *pool = worker->pool;
+	unsigned self = (unsigned) (worker - pool->workers);
+	for (unsigned k = 0; k < pool->num_workers; k++) {
+		lfr_worker_t *victim = &pool->workers[(self + k) % pool->num_workers];
+		unsigned item;
+		while ((item = atomic_fetch_add(&victim->next, 1)) < victim->end) {
+			worker->num_steps += pool->job(item, pool->job_data);
+		}
+	}
+}
+
+
+/* Worker thread main loop (waits for jobs until the pool is terminated). */
+void* lfr_worker_main_(void *arg) {
+	lfr_worker_t *worker = arg;
+	lfr_worker_pool_t *pool = worker->pool;
+	unsigned seen_job = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->job_number == seen_job) {
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+		}
+		if (pool->quit) { break; }
+		seen_job = pool->job_number;
+
+		pthread_mutex_unlock(&pool->lock);
+		lfr_work_(worker);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->num_working == 0) {
+			pthread_cond_signal(&pool->job_done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/**
+Initialize worker pool with the given number of threads (including the calling thread).
+
+A pool with a single thread does all work in the calling thread.
+**/
+void lfr_init_worker_pool(unsigned num_threads, lfr_worker_pool_t *pool) {
+	assert(pool && num_threads > 0);
+	*pool = (lfr_worker_pool_t) { .num_workers = num_threads };
+	pool->workers = aligned_alloc(_Alignof(lfr_worker_t), num_threads * sizeof(lfr_worker_t));
+	assert(pool->workers);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_ready, NULL);
+	pthread_cond_init(&pool->job_done, NULL);
+
+	// Start all workers but the last one (that is the calling thread)
+	for (unsigned w = 0; w < num_threads; w++) {
+		pool->workers[w] = (lfr_worker_t) { .pool = pool };
+		atomic_init(&pool->workers[w].next, 0);
+		if (w + 1 < num_threads) {
+			int error = pthread_create(&pool->workers[w].thread, NULL, lfr_worker_main_, &pool->workers[w]);
+			assert(!error);
+		}
+	}
+}
+
+
+/**
+Terminate worker pool, joining all threads.
+**/
+void lfr_term_worker_pool(lfr_worker_pool_t *pool) {
+	assert(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned w = 0; w + 1 < pool->num_workers; w++) {
+		pthread_join(pool->workers[w].thread, NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->job_ready);
+	pthread_cond_destroy(&pool->job_done);
+	free(pool->workers);
+	*pool = (lfr_worker_pool_t) {0};
+}
 
-		return true;
+
+/**
+Run job for every item (in any order and on any thread), returning the sum of what the job returned.
+
+Returns when all items are done. Every item is done exactly once.
+**/
+unsigned lfr_run_worker_pool(unsigned num_items, unsigned (*job)(unsigned item, void *data), void *data,
+		lfr_worker_pool_t *pool) {
+	assert(job && pool);
+	if (!num_items) { return 0; }
+
+	// Give every worker an equal share
+	pthread_mutex_lock(&pool->lock);
+	const unsigned n = pool->num_workers;
+	for (unsigned w = 0; w < n; w++) {
+		atomic_store(&pool->workers[w].next, (unsigned) ((unsigned long long) num_items * w / n));
+		pool->workers[w].end = (unsigned) ((unsigned long long) num_items * (w + 1) / n);
+		pool->workers[w].num_steps = 0;
 	}
+	pool->job = job;
+	pool->job_data = data;
+	pool->num_working = n - 1;
+	pool->job_number++;
+	pthread_cond_broadcast(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	// Join in, then wait for the others
+	lfr_work_(&pool->workers[n - 1]);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->num_working) {
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
 
-	return false;
+	unsigned sum = 0;
+	for (unsigned w = 0; w < n; w++) { sum += pool->workers[w].num_steps; }
+	return sum;
+}
+
+
+/* Stepping job data (for states or world instances). */
+typedef struct lfr_step_job_ {
+	unsigned max_steps;
+	lfr_graph_state_t **states;
+	lfr_world_t *world;
+	const lfr_vm_t *vm;
+	const lfr_graph_t *graph;
+	const lfr_program_t *program;
+} lfr_step_job_t;
+
+unsigned lfr_step_state_job_(unsigned item, void *data) {
+	lfr_step_job_t *job = data;
+	return lfr_step_state_(job->max_steps, job->vm, job->graph, job->program, job->states[item]);
+}
+
+unsigned lfr_step_world_instance_job_(unsigned item, void *data) {
+	lfr_step_job_t *job = data;
+	lfr_graph_state_t *state = &job->world->instances[job->world->active[item]].state;
+	lfr_set_state_clock_(job->world->clock, state);
+	return lfr_step_state_(job->max_steps, job->vm, job->graph, job->program, state);
 }
 
 
 /**
-How many links have this node as source?
+Step all given states of the same graph (at most) the given number of times, spread over the pool.
+
+Pass a program compiled from the graph to run it instead of interpreting the graph (or NULL).
+
+Every state is stepped by one thread at a time, so each state progresses
+exactly as if stepped on its own (as long as custom instructions only touch their own state).
+Returns the total number of steps taken.
 **/
-unsigned lfr_count_node_source_links(lfr_node_id_t source_node, const lfr_graph_t *graph) {
-	unsigned count = 0;
+unsigned lfr_step_states_in_pool(unsigned max_steps, lfr_graph_state_t **states, unsigned num_states,
+		const lfr_vm_t *vm, const lfr_graph_t *graph, const lfr_program_t *program, lfr_worker_pool_t *pool) {
+	assert(states && vm && graph && pool);
+	lfr_step_job_t job = { max_steps, states, NULL, vm, graph, program };
+	return lfr_run_worker_pool(num_states, lfr_step_state_job_, &job, pool);
+}
 
-	for (int i = 0; i < graph->num_flow_links; i++) {
-		const lfr_flow_link_t *link = &graph->flow_links[i];
-		if ( T_SAME_ID(source_node, link->source_node)) { count++; }
+
+/**
+Same as `lfr_step_world()`, but spreading active instances over the pool.
+**/
+unsigned lfr_step_world_in_pool(unsigned max_steps, lfr_world_t *world, lfr_worker_pool_t *pool) {
+	assert(world && pool);
+	lfr_step_job_t job = { max_steps, NULL, world, world->vm, world->graph, world->program };
+	unsigned num_steps = lfr_run_worker_pool(world->num_active, lfr_step_world_instance_job_, &job, pool);
+	lfr_drop_idle_world_instances_(world);
+	return num_steps;
+}
+
+#endif
+
+
+//// LFR Graph ////
+
+/**
+Initialize an LFR graph.
+**/
+void lfr_init_graph(lfr_graph_t *graph) {
+	*graph = (lfr_graph_t) {0};
+	graph->nodes.next_id = 1;
+	graph->next_node_pos = (lfr_vec2_t) {100,100};
+}
+
+
+/**
+Terminate an LFR graph.
+
+Releases all memory owned by the graph.
+**/
+void lfr_term_graph(lfr_graph_t *graph) {
+	assert(graph);
+	lfr_term_node_table(&graph->nodes);
+	lfr_term_node_groups_(&graph->flow_targets);
+	lfr_term_node_groups_(&graph->flow_sources);
+	free(graph->flow_links);
+	graph->flow_links = NULL;
+	graph->num_flow_links = graph->max_flow_links = 0;
+}
+
+
+/**
+Add a node with the given *core* instruction to the graph.
+
+Node is positioned to the right of the last node in the table.
+**/
+lfr_node_id_t lfr_add_node(lfr_instruction_e inst, lfr_graph_t *graph) {
+	assert(inst < lfr_no_core_instructions);
+	lfr_node_id_t id = lfr_insert_node_into_table(inst, NULL, &graph->nodes);
+	graph->nodes.position[graph->nodes.num_rows - 1] = graph->next_node_pos;
+	graph->next_node_pos.x += 310;
+	return id;
+}
+
+
+/**
+Add a node with the given *custom* instruction to the graph.
+
+Same layout system as core nodes.
+The vm is needed to find out how many slots the node has.
+**/
+lfr_node_id_t lfr_add_custom_node(unsigned inst, const lfr_vm_t *vm, lfr_graph_t *graph) {
+	assert(vm && graph);
+	inst += 1 << 8;
+	lfr_node_id_t id = lfr_insert_node_into_table(inst, vm, &graph->nodes);
+	graph->nodes.position[graph->nodes.num_rows - 1] = graph->next_node_pos;
+	graph->next_node_pos.x += 310;
+	return id;
+}
+
+
+/**
+Remove node from graph, including all links to and from it.
+**/
+void lfr_remove_node(lfr_node_id_t id, lfr_graph_t *graph) {
+	assert(graph && T_IS_LIVE(graph->nodes, id));
+
+	lfr_disconnect_node(id, graph);
+	lfr_remove_node_from_table(id, &graph->nodes);
+}
+
+
+/**
+Link execution of one node to another.
+**/
+void lfr_link_nodes(lfr_node_id_t source_node, lfr_node_id_t target_node, lfr_graph_t *graph) {
+	assert(graph);
+	assert(T_IS_LIVE(graph->nodes, source_node) && T_IS_LIVE(graph->nodes, target_node));
+
+	// Prevent duplicates
+	if (lfr_has_link(source_node, target_node, graph)) { return; };
+
+	// Add (non-duplicate link)
+	if (graph->num_flow_links == graph->max_flow_links) {
+		graph->max_flow_links = lfr_grow_capacity_(graph->max_flow_links, graph->num_flow_links + 1);
+		T_RESIZE_COLUMN(graph->flow_links, graph->max_flow_links);
 	}
+	unsigned link = graph->num_flow_links++;
+	graph->flow_links[link] = (lfr_flow_link_t) {source_node, target_node};
 
-	return count;
+	// Index link in both directions
+	lfr_add_to_node_group_(source_node.id, target_node, link, &graph->flow_targets);
+	lfr_add_to_node_group_(target_node.id, source_node, link, &graph->flow_sources);
+}
+
+
+/**
+Is there a linke from one node to the other?
+**/
+bool lfr_has_link(lfr_node_id_t source_node, lfr_node_id_t target_node, const lfr_graph_t *graph) {
+	return lfr_find_in_node_group_(source_node.id, target_node, &graph->flow_targets) != UINT_MAX;
+}
+
+
+/**
+How many links have this node as source?
+**/
+unsigned lfr_count_node_source_links(lfr_node_id_t source_node, const lfr_graph_t *graph) {
+	const lfr_node_id_t *targets;
+	return lfr_get_node_flow_targets(source_node, graph, &targets);
 }
 
 
@@ -637,29 +2734,55 @@ unsigned lfr_count_node_source_links(lfr_node_id_t source_node, const lfr_graph_
 How many links have this node as target?
 **/
 unsigned lfr_count_node_target_links(lfr_node_id_t target_node, const lfr_graph_t *graph) {
-	unsigned count = 0;
+	const lfr_node_id_t *sources;
+	return lfr_get_node_flow_sources(target_node, graph, &sources);
+}
 
-	for (int i = 0; i < graph->num_flow_links; i++) {
-		const lfr_flow_link_t *link = &graph->flow_links[i];
-		if ( T_SAME_ID(target_node, link->target_node)) { count++; }
-	}
 
-	return count;
+/**
+Get all nodes that follow the given node in the flow.
+
+Points `targets` at (read only) ids of the target nodes and returns how many there are.
+The ids are only valid until the next time the graph flow is changed.
+**/
+unsigned lfr_get_node_flow_targets(lfr_node_id_t source_node, const lfr_graph_t *graph,
+		const lfr_node_id_t **targets) {
+	assert(graph && targets);
+	return lfr_get_node_group_(source_node.id, &graph->flow_targets, targets);
+}
+
+
+/**
+Get all nodes that precede the given node in the flow.
+
+Same rules apply as for `lfr_get_node_flow_targets()`.
+**/
+unsigned lfr_get_node_flow_sources(lfr_node_id_t target_node, const lfr_graph_t *graph,
+		const lfr_node_id_t **sources) {
+	assert(graph && sources);
+	return lfr_get_node_group_(target_node.id, &graph->flow_sources, sources);
 }
 
+
 /**
 Break execution link from one node to another.
 **/
 void lfr_unlink_nodes(lfr_node_id_t source_node, lfr_node_id_t target_node, lfr_graph_t *graph) {
-	for (int i = 0; i < graph->num_flow_links; i++) {
-		lfr_flow_link_t *link = &graph->flow_links[i];
-		if ( !T_SAME_ID(source_node, link->source_node)) { continue; }
-		if ( !T_SAME_ID(target_node, link->target_node)) { continue; }
-
-		// Remove (breaking order)
-		graph->flow_links[i] = graph->flow_links[--graph->num_flow_links];
-		return;
-	}
+	lfr_node_groups_t *targets = &graph->flow_targets, *sources = &graph->flow_sources;
+	unsigned at = lfr_find_in_node_group_(source_node.id, target_node, targets);
+	if (at == UINT_MAX) { return; }
+	unsigned link = targets->tag[source_node.id][at];
+
+	// Remove from index (keeping the order targets are scheduled in)
+	lfr_cut_from_node_group_(source_node.id, at, targets);
+	lfr_cut_from_node_group_(target_node.id, lfr_find_in_node_group_(target_node.id, source_node, sources), sources);
+
+	// Remove (breaking order), then retag the link moved into its place
+	unsigned moved = --graph->num_flow_links;
+	if (link == moved) { return; }
+	lfr_flow_link_t last = graph->flow_links[link] = graph->flow_links[moved];
+	targets->tag[last.source_node.id][lfr_find_in_node_group_(last.source_node.id, last.target_node, targets)] = link;
+	sources->tag[last.target_node.id][lfr_find_in_node_group_(last.target_node.id, last.source_node, sources)] = link;
 }
 
 
@@ -667,25 +2790,26 @@ void lfr_unlink_nodes(lfr_node_id_t source_node, lfr_node_id_t target_node, lfr_
 Completely disconnect given node from other nodes in the graph.
 **/
 void lfr_disconnect_node(lfr_node_id_t id, lfr_graph_t *graph) {
-	assert(graph && T_HAS_ID(graph->nodes, id));
+	assert(graph && T_IS_LIVE(graph->nodes, id));
 
 	// Disconnet from main flow
-	for (int i = 0; i < graph->num_flow_links; i++) {
-		lfr_flow_link_t *link = &graph->flow_links[i];
-		if (T_SAME_ID(link->source_node, id) || T_SAME_ID(link->target_node, id)) {
-			graph->flow_links[i--] = graph->flow_links[--graph->num_flow_links];
-		}
+	// (unlinking changes the index, so always take the last remaining link)
+	const lfr_node_id_t *linked;
+	unsigned num_linked;
+	while ((num_linked = lfr_get_node_flow_targets(id, graph, &linked))) {
+		lfr_unlink_nodes(id, linked[num_linked - 1], graph);
+	}
+	while ((num_linked = lfr_get_node_flow_sources(id, graph, &linked))) {
+		lfr_unlink_nodes(linked[num_linked - 1], id, graph);
 	}
 
-	// Disconnect data links
-	for (int node_index = 0; node_index < graph->nodes.num_rows; node_index++) {
-		lfr_node_t *node = &graph->nodes.node[node_index];
-
-		// Clear all slots refering to the given node
-		for (int slot = 0; slot < lfr_signature_size; slot++) {
-			if (!T_SAME_ID(node->input_data[slot].node, id)) { continue; }
-			node->input_data[slot].node = (lfr_node_id_t) { 0 };
-		}
+	// Disconnect data links (in both directions)
+	const lfr_node_t *node = &graph->nodes.node[T_INDEX(graph->nodes, id)];
+	for (unsigned slot = 0; slot < node->num_inputs; slot++) {
+		lfr_unlink_input_data(id, slot, graph);
+	}
+	for (unsigned slot = 0; slot < node->num_outputs; slot++) {
+		lfr_unlink_output_data(id, slot, graph);
 	}
 }
 
@@ -700,16 +2824,10 @@ API note:
 void lfr_link_data(lfr_node_id_t out_node, unsigned out_slot, lfr_node_id_t in_node, unsigned in_slot,
 		lfr_graph_t* graph) {
 	assert(graph);
-	assert(T_HAS_ID(graph->nodes, out_node) && T_HAS_ID(graph->nodes, in_node));
+	assert(T_IS_LIVE(graph->nodes, out_node) && T_IS_LIVE(graph->nodes, in_node));
 	assert(out_slot < lfr_signature_size && in_slot < lfr_signature_size);
 
-	// Get node table (the only data we actuall need)
-	lfr_node_table_t *table = &graph->nodes;
-
-	// Set link
-	unsigned in_index = T_INDEX(*table, in_node);
-	table->node[in_index].input_data[in_slot].node = out_node;
-	table->node[in_index].input_data[in_slot].slot = out_slot;
+	lfr_link_data_in_table_(out_node, out_slot, in_node, in_slot, &graph->nodes);
 }
 
 
@@ -717,37 +2835,71 @@ void lfr_link_data(lfr_node_id_t out_node, unsigned out_slot, lfr_node_id_t in_n
 Unlink given input node slot from any linked output slots.
 **/
 void lfr_unlink_input_data(lfr_node_id_t in_node, unsigned in_slot, lfr_graph_t *graph) {
-	assert(graph && T_HAS_ID(graph->nodes, in_node));
+	assert(graph && T_IS_LIVE(graph->nodes, in_node));
 	assert(in_slot < lfr_signature_size);
 
-	// Clear node
-	lfr_node_t *node = &graph->nodes.node[T_INDEX(graph->nodes, in_node)];
-	node->input_data[in_slot].node = (lfr_node_id_t) {0};
-	node->input_data[in_slot].slot = 0;
+	lfr_unlink_input_data_in_table_(T_INDEX(graph->nodes, in_node), in_slot, &graph->nodes);
 }
 
 
 /**
 Unlink given output node slot from all linked input slots.
+
+Only visits the input slots actually linked to the output (thanks to the reverse index).
 **/
 void lfr_unlink_output_data(lfr_node_id_t out_node, unsigned out_slot, lfr_graph_t *graph) {
-	assert(graph && T_HAS_ID(graph->nodes, out_node));
+	assert(graph && T_IS_LIVE(graph->nodes, out_node));
 	assert(out_slot < lfr_signature_size);
 
-	// Cycle through all nodes
-	for (int node_index = 0; node_index < graph->nodes.num_rows; node_index++) {
-		lfr_node_t *node = &graph->nodes.node[node_index];
+	lfr_unlink_output_data_in_table_(T_INDEX(graph->nodes, out_node), out_slot, &graph->nodes);
+}
 
-		// Cycle through all slots
-		for (int in_slot = 0; in_slot < lfr_signature_size; in_slot++) {
-			if (!T_SAME_ID(node->input_data[in_slot].node, out_node)) { continue; }
-			if (node->input_data[in_slot].slot != out_slot) { continue; }
 
-			// clear matching slot
-			node->input_data[in_slot].node.id = 0;
-			node->input_data[in_slot].slot = 0;
-		}
+/**
+Get the first input slot linked to the given output slot (null reference if there is none).
+
+Continue with `lfr_get_next_data_reader()` to get the rest.
+Order of readers is unspecified.
+**/
+lfr_slot_ref_t lfr_get_first_data_reader(lfr_node_id_t out_node, unsigned out_slot, const lfr_graph_t *graph) {
+	assert(graph && T_IS_LIVE(graph->nodes, out_node));
+	return graph->nodes.slot[lfr_output_slot_(T_INDEX(graph->nodes, out_node), out_slot, &graph->nodes)].link;
+}
+
+
+/**
+Get the next input slot linked to the same output as the given one (null reference if there is none).
+**/
+lfr_slot_ref_t lfr_get_next_data_reader(lfr_slot_ref_t reader, const lfr_graph_t *graph) {
+	assert(graph);
+	if (!T_IS_LIVE(graph->nodes, reader.node)) { return (lfr_slot_ref_t) {0}; }
+	return graph->nodes.next_reader[lfr_input_slot_(T_INDEX(graph->nodes, reader.node), reader.slot, &graph->nodes)];
+}
+
+
+/**
+How many input slots are linked to the given output slot?
+**/
+unsigned lfr_count_data_readers(lfr_node_id_t out_node, unsigned out_slot, const lfr_graph_t *graph) {
+	unsigned count = 0;
+	lfr_slot_ref_t reader = lfr_get_first_data_reader(out_node, out_slot, graph);
+	while (T_IS_LIVE(graph->nodes, reader.node)) {
+		count++;
+		reader = lfr_get_next_data_reader(reader, graph);
 	}
+	return count;
+}
+
+
+/**
+Get the output slot linked to the given input slot (null reference if there is none).
+**/
+lfr_slot_ref_t lfr_get_data_link(lfr_node_id_t in_node, unsigned in_slot, const lfr_graph_t *graph) {
+	assert(graph && T_IS_LIVE(graph->nodes, in_node));
+	unsigned index = T_INDEX(graph->nodes, in_node);
+	assert(in_slot < graph->nodes.node[index].num_inputs);
+	if (!(graph->nodes.node[index].linked & (1u << in_slot))) { return (lfr_slot_ref_t) {0}; }
+	return graph->nodes.slot[lfr_input_slot_(index, in_slot, &graph->nodes)].link;
 }
 
 
@@ -756,8 +2908,7 @@ Count number of *inputs* of the instruction of the given node.
 **/
 unsigned lfr_count_node_inputs(lfr_node_id_t id, const lfr_vm_t *vm, lfr_graph_t *graph) {
 	assert(vm && graph);
-	const lfr_node_t *node = &graph->nodes.node[T_INDEX(graph->nodes, id)];
-	return lfr_count_instruction_inputs(node->instruction, vm);
+	return graph->nodes.node[T_INDEX(graph->nodes, id)].num_inputs;
 }
 
 
@@ -766,8 +2917,7 @@ Count number of *outputs* of the instruction of the given node.
 **/
 unsigned lfr_count_node_outputs(lfr_node_id_t id, const lfr_vm_t *vm, lfr_graph_t *graph) {
 	assert(vm && graph);
-	const lfr_node_t *node = &graph->nodes.node[T_INDEX(graph->nodes, id)];
-	return lfr_count_instruction_outputs(node->instruction, vm);
+	return graph->nodes.node[T_INDEX(graph->nodes, id)].num_outputs;
 }
 
 
@@ -790,149 +2940,433 @@ void lfr_load_graph_from_file(FILE * restrict stream, const lfr_vm_t *vm, lfr_gr
 	char line_buf[1024];
 	while (fgets(line_buf, 1024, stream)) {
 		// Get line type
-		char type_buf[8];
-		sscanf(line_buf, "%s", type_buf);
+		char type_buf[16] = "";
+		sscanf(line_buf, "%15s", type_buf);
 
 		// Parse various line types
 		if (strlen(type_buf) == 0) {
 			/* Skip if empty */
 		} else if (strcmp(type_buf, "node") == 0) {
 			// Parse instruction
-			lfr_node_id_t id;
+			unsigned id;
 			char inst_buf[32];
-			sscanf(line_buf, "node #%u %32s", &id.id, inst_buf);
+			sscanf(line_buf, "node #%u %32s", &id, inst_buf);
 
 			// Add instruction node
 			lfr_instruction_e instruction = lfr_find_instruction_from_name(inst_buf, vm);
-			lfr_node_id_t tmp_id = lfr_insert_node_into_table(instruction, &graph->nodes);
-			if (!T_SAME_ID(tmp_id, id)) {
+			lfr_node_id_t tmp_id = lfr_insert_node_into_table(instruction, vm, &graph->nodes);
+			if (tmp_id.id != id) {
 				lfr_change_node_id_in_table(tmp_id, id, &graph->nodes);
 			}
 
 		} else if (strcmp(type_buf, "place") == 0) {
-			lfr_node_id_t id;
+			unsigned id;
 			lfr_vec2_t pos;
-			sscanf(line_buf, "place #%u (%f,%f)", &id.id, &pos.x, &pos.y);
-			lfr_set_node_position(id, pos, &graph->nodes);
+			sscanf(line_buf, "place #%u (%f,%f)", &id, &pos.x, &pos.y);
+			lfr_set_node_position(lfr_get_node_id(id, &graph->nodes), pos, &graph->nodes);
+
+		} else if (strcmp(type_buf, "priority") == 0) {
+			unsigned id;
+			char name_buf[16] = "";
+			sscanf(line_buf, "priority #%u %15s", &id, name_buf);
+			lfr_priority_e priority = 0;
+			while (priority < lfr_no_priorities && strcmp(name_buf, lfr_get_priority_name(priority)) != 0) {
+				priority++;
+			}
+			if (priority == lfr_no_priorities) {
+				fprintf(stderr, "%s():\tSkipping unknown priority '%s' for #%u.\n", __func__, name_buf, id);
+				continue;
+			}
+			lfr_set_node_priority(lfr_get_node_id(id, &graph->nodes), priority, &graph->nodes);
 
 		} else if (strcmp(type_buf, "data") == 0) {
-			lfr_node_id_t output_node, input_node;
+			unsigned output_id, input_id;
 			unsigned output_slot, input_slot;
 			sscanf(line_buf, "data #%u:%u -> #%u:%u",
-				&output_node.id, &output_slot, &input_node.id, &input_slot);
+				&output_id, &output_slot, &input_id, &input_slot);
+			lfr_node_id_t output_node = lfr_get_node_id(output_id, &graph->nodes);
+			lfr_node_id_t input_node = lfr_get_node_id(input_id, &graph->nodes);
+			if (output_slot >= lfr_count_node_outputs(output_node, vm, graph)
+				|| input_slot >= lfr_count_node_inputs(input_node, vm, graph)) {
+				fprintf(stderr,
+					"%s():\tSkipping data link to or from undeclared slot (#%u:%u -> #%u:%u).\n",
+					__func__, output_id, output_slot, input_id, input_slot);
+				continue;
+			}
 			lfr_link_data(output_node, output_slot, input_node, input_slot, graph);
 		} else if (strcmp(type_buf, "value") == 0) {
-			lfr_node_id_t input_node;
+			unsigned input_id;
 			unsigned input_slot;
 			char type_buf[9];
 			int n;
-			sscanf(line_buf, "value #%u:%u = %8s %n", &input_node.id, &input_slot, type_buf, &n);
+			sscanf(line_buf, "value #%u:%u = %8s %n", &input_id, &input_slot, type_buf, &n);
+			lfr_node_id_t input_node = lfr_get_node_id(input_id, &graph->nodes);
+			if (input_slot >= lfr_count_node_inputs(input_node, vm, graph)) {
+				fprintf(stderr,
+					"%s():\tSkipping value for undeclared slot #%u:%u.\n",
+					__func__, input_id, input_slot);
+				continue;
+			}
 
 			// Read type specific value from the rest of the line
 			if (strcmp(type_buf, "float") == 0) {
-				lfr_variant_t var = {lfr_float_type};
-				sscanf(&line_buf[n], "%f", &var.float_value);
-				lfr_set_fixed_input_value(input_node, input_slot, var, &graph->nodes);
+				float value = 0;
+				sscanf(&line_buf[n], "%f", &value);
+				lfr_set_fixed_input_value(input_node, input_slot, lfr_float(value), &graph->nodes);
 			} else if (strcmp(type_buf, "bool") == 0) {
 				char c;
 				sscanf(&line_buf[n], "%c", &c);
 				lfr_variant_t var = lfr_bool(c == 't');
 				lfr_set_fixed_input_value(input_node, input_slot, var, &graph->nodes);
 			} else if (strcmp(type_buf, "int") == 0) {
-				lfr_variant_t var = {lfr_int_type};
-				sscanf(&line_buf[n], "%d", &var.int_value);
-				lfr_set_fixed_input_value(input_node, input_slot, var, &graph->nodes);
+				int value = 0;
+				sscanf(&line_buf[n], "%d", &value);
+				lfr_set_fixed_input_value(input_node, input_slot, lfr_int(value), &graph->nodes);
 			} else if (strcmp(type_buf, "vec2") == 0) {
-				lfr_variant_t var = {lfr_vec2_type};
-				sscanf(&line_buf[n], "(%f, %f)", &var.vec2_value.x, &var.vec2_value.y);
-				lfr_set_fixed_input_value(input_node, input_slot, var, &graph->nodes);
+				lfr_vec2_t value = LFR_VEC2_ORIGO;
+				sscanf(&line_buf[n], "(%f, %f)", &value.x, &value.y);
+				lfr_set_fixed_input_value(input_node, input_slot, lfr_vec2(value), &graph->nodes);
 			} else {
 				fprintf(stderr,
 					"%s():\tSkipping unknown type '%s' for #%u:%u.\n",
 					__func__, type_buf, input_node.id, input_slot);
 			}
 
-		} else if (strcmp(type_buf, "link") == 0) {
-			// Parse and create link
-			lfr_node_id_t source, target;
-			sscanf(line_buf, "link #%u -> #%u", &source.id, &target.id);
-			lfr_link_nodes(source, target, graph);
-		} else {
-			fprintf(stderr, "Unknown type '%s'\n", type_buf);
-		}
+		} else if (strcmp(type_buf, "link") == 0) {
+			// Parse and create link
+			unsigned source_id, target_id;
+			sscanf(line_buf, "link #%u -> #%u", &source_id, &target_id);
+			lfr_node_id_t source = lfr_get_node_id(source_id, &graph->nodes);
+			lfr_node_id_t target = lfr_get_node_id(target_id, &graph->nodes);
+			lfr_link_nodes(source, target, graph);
+		} else {
+			fprintf(stderr, "Unknown type '%s'\n", type_buf);
+		}
+	}
+}
+
+
+/**
+Save graph to file at the given path.
+
+Utility function that just handles file opening and closing for you.
+**/
+void lfr_save_graph_to_file_path(const lfr_graph_t *graph, const lfr_vm_t *vm, const char *path) {
+	FILE * fp = fopen(path, "w");
+	lfr_save_graph_to_file(graph, vm, fp);
+	fclose(fp);
+}
+
+
+/**
+Dump graph to file in a parsable (tab-separated) format.
+**/
+int lfr_save_graph_to_file(const lfr_graph_t *graph, const lfr_vm_t *vm, FILE * restrict stream) {
+	int char_count = 0;
+
+	// Dump things
+	char_count += lfr_save_nodes_in_table_to_file(&graph->nodes, vm, stream);
+	char_count += lfr_save_node_placements_in_table_to_file(&graph->nodes, vm, stream);
+	char_count += lfr_save_node_priorities_in_table_to_file(&graph->nodes, stream);
+	char_count += lfr_save_data_links_in_table_to_file(&graph->nodes, stream);
+	char_count += lfr_save_fixed_values_in_table_to_file(&graph->nodes, stream);
+	char_count += lfr_save_flow_links_to_file(graph, stream);
+
+	return char_count;
+}
+
+
+/**
+Dump main flow links in a parsable (tab-separated) format.
+**/
+int lfr_save_flow_links_to_file(const lfr_graph_t *graph, FILE * restrict stream) {
+	int char_count = 0;
+
+	// Flow links in graph
+	for (int i = 0; i < graph->num_flow_links; i++) {
+		const lfr_flow_link_t *link = &graph->flow_links[i];
+		char_count += fprintf(stream, "link\t");
+		char_count += fprintf(stream, "#%u -> #%u", link->source_node.id, link->target_node.id);
+		char_count += fprintf(stream, "\n");
+	}
+
+	return char_count;
+}
+
+
+//// LFR Node index ////
+
+/*
+Add a node to the end of the run of the given key (returns where in the run it ends up).
+*/
+unsigned lfr_add_to_node_group_(unsigned key, lfr_node_id_t node, unsigned tag, lfr_node_groups_t *groups) {
+	assert(groups);
+
+	// Make room for key (new keys have empty runs)
+	if (key >= groups->key_range) {
+		unsigned old_range = groups->key_range;
+		groups->key_range = lfr_grow_capacity_(groups->key_range, key + 1);
+		T_RESIZE_COLUMN(groups->nodes, groups->key_range);
+		T_RESIZE_COLUMN(groups->tag, groups->key_range);
+		T_RESIZE_COLUMN(groups->num_nodes, groups->key_range);
+		T_RESIZE_COLUMN(groups->max_nodes, groups->key_range);
+		for (unsigned k = old_range; k < groups->key_range; k++) {
+			groups->nodes[k] = NULL;
+			groups->tag[k] = NULL;
+			groups->num_nodes[k] = groups->max_nodes[k] = 0;
+		}
+	}
+
+	// Make room for node
+	if (groups->num_nodes[key] == groups->max_nodes[key]) {
+		groups->max_nodes[key] = lfr_grow_capacity_(groups->max_nodes[key], groups->num_nodes[key] + 1);
+		T_RESIZE_COLUMN(groups->nodes[key], groups->max_nodes[key]);
+		T_RESIZE_COLUMN(groups->tag[key], groups->max_nodes[key]);
+	}
+
+	unsigned at = groups->num_nodes[key]++;
+	groups->nodes[key][at] = node;
+	groups->tag[key][at] = tag;
+	return at;
+}
+
+
+/*
+Remove the node at the given place in the run of the given key.
+
+Returns the node moved into its place (null id if it was the last one of the run).
+*/
+lfr_node_id_t lfr_remove_from_node_group_(unsigned key, unsigned at, lfr_node_groups_t *groups) {
+	assert(groups && key < groups->key_range && at < groups->num_nodes[key]);
+	unsigned last = --groups->num_nodes[key];
+	if (at == last) { return (lfr_node_id_t) {0}; }
+	groups->nodes[key][at] = groups->nodes[key][last];
+	groups->tag[key][at] = groups->tag[key][last];
+	return groups->nodes[key][at];
+}
+
+
+/*
+Remove the node at the given place in the run of the given key, keeping the order of the nodes after it.
+*/
+void lfr_cut_from_node_group_(unsigned key, unsigned at, lfr_node_groups_t *groups) {
+	assert(groups && key < groups->key_range && at < groups->num_nodes[key]);
+	unsigned num_after = --groups->num_nodes[key] - at;
+	memmove(&groups->nodes[key][at], &groups->nodes[key][at + 1], sizeof(lfr_node_id_t) * num_after);
+	memmove(&groups->tag[key][at], &groups->tag[key][at + 1], sizeof(unsigned) * num_after);
+}
+
+
+/*
+Find where the given node is in the run of the given key (UINT_MAX if it is not there).
+*/
+unsigned lfr_find_in_node_group_(unsigned key, lfr_node_id_t node, const lfr_node_groups_t *groups) {
+	if (key >= groups->key_range) { return UINT_MAX; }
+	for (unsigned at = 0; at < groups->num_nodes[key]; at++) {
+		if (T_SAME_ID(groups->nodes[key][at], node)) { return at; }
+	}
+	return UINT_MAX;
+}
+
+
+/*
+Get the run of nodes of the given key.
+*/
+unsigned lfr_get_node_group_(unsigned key, const lfr_node_groups_t *groups, const lfr_node_id_t **nodes) {
+	if (key >= groups->key_range) {
+		*nodes = NULL;
+		return 0;
+	}
+
+	*nodes = groups->nodes[key];
+	return groups->num_nodes[key];
+}
+
+
+/*
+Release all memory held by the groups.
+*/
+void lfr_term_node_groups_(lfr_node_groups_t *groups) {
+	for (unsigned k = 0; k < groups->key_range; k++) {
+		free(groups->nodes[k]);
+		free(groups->tag[k]);
 	}
+	free(groups->nodes);
+	free(groups->tag);
+	free(groups->num_nodes);
+	free(groups->max_nodes);
+	*groups = (lfr_node_groups_t) {0};
 }
 
 
+//// LFR Node table ////
+
 /**
-Save graph to file at the given path.
+Make sure that the table has room for (at least) the given number of rows.
 
-Utility function that just handles file opening and closing for you.
+Tables grow automatically when nodes are inserted,
+so this is only needed to avoid repeated reallocation when the final size is known up front.
 **/
-void lfr_save_graph_to_file_path(const lfr_graph_t *graph, const lfr_vm_t *vm, const char *path) {
-	FILE * fp = fopen(path, "w");
-	lfr_save_graph_to_file(graph, vm, fp);
-	fclose(fp);
+void lfr_reserve_node_table_rows(unsigned num_rows, lfr_node_table_t *table) {
+	assert(table);
+	if (num_rows <= table->max_rows) { return; }
+
+	table->max_rows = lfr_grow_capacity_(table->max_rows, num_rows);
+	T_RESIZE_COLUMN(table->dense_id, table->max_rows);
+	T_RESIZE_COLUMN(table->node, table->max_rows);
+	T_RESIZE_COLUMN(table->position, table->max_rows);
+	T_RESIZE_COLUMN(table->instruction_at, table->max_rows);
 }
 
 
 /**
-Dump graph to file in a parsable (tab-separated) format.
+Release memory reserved for rows (and slots) that are not in use.
 **/
-int lfr_save_graph_to_file(const lfr_graph_t *graph, const lfr_vm_t *vm, FILE * restrict stream) {
-	int char_count = 0;
+void lfr_shrink_node_table(lfr_node_table_t *table) {
+	assert(table);
+	if (table->num_unused_slots) { lfr_compact_node_slots_(table); }
+	if (table->num_slots < table->max_slots) {
+		table->max_slots = table->num_slots;
+		T_RESIZE_COLUMN(table->slot, table->max_slots);
+		T_RESIZE_COLUMN(table->next_reader, table->max_slots);
+	}
+	if (table->num_rows == table->max_rows) { return; }
 
-	// Dump things
-	char_count += lfr_save_nodes_in_table_to_file(&graph->nodes, vm, stream);
-	char_count += lfr_save_node_placements_in_table_to_file(&graph->nodes, vm, stream);
-	char_count += lfr_save_data_links_in_table_to_file(&graph->nodes, stream);
-	char_count += lfr_save_fixed_values_in_table_to_file(&graph->nodes, stream);
-	char_count += lfr_save_flow_links_to_file(graph, stream);
+	table->max_rows = table->num_rows;
+	T_RESIZE_COLUMN(table->dense_id, table->max_rows);
+	T_RESIZE_COLUMN(table->node, table->max_rows);
+	T_RESIZE_COLUMN(table->position, table->max_rows);
+	T_RESIZE_COLUMN(table->instruction_at, table->max_rows);
+}
 
-	return char_count;
+
+/*
+Take a run of (cleared) slots at the end of the slot pool, returning the first of them.
+*/
+unsigned lfr_take_node_slots_(unsigned num_slots, lfr_node_table_t *table) {
+	if (table->num_slots + num_slots > table->max_slots) {
+		table->max_slots = lfr_grow_capacity_(table->max_slots, table->num_slots + num_slots);
+		T_RESIZE_COLUMN(table->slot, table->max_slots);
+		T_RESIZE_COLUMN(table->next_reader, table->max_slots);
+	}
+
+	unsigned first = table->num_slots;
+	for (unsigned i = first; i < first + num_slots; i++) {
+		table->slot[i] = (lfr_slot_t) { LFR_NIL };
+		table->next_reader[i] = (lfr_slot_ref_t) {0};
+	}
+	table->num_slots += num_slots;
+	return first;
 }
 
 
-/**
-Dump main flow links in a parsable (tab-separated) format.
-**/
-int lfr_save_flow_links_to_file(const lfr_graph_t *graph, FILE * restrict stream) {
-	int char_count = 0;
+/*
+Move the slots of all rows to the start of the slot pool (in row order), dropping unused slots.
+*/
+void lfr_compact_node_slots_(lfr_node_table_t *table) {
+	lfr_slot_t *slot = NULL;
+	lfr_slot_ref_t *next_reader = NULL;
+	T_RESIZE_COLUMN(slot, table->max_slots);
+	T_RESIZE_COLUMN(next_reader, table->max_slots);
 
-	// Flow links in graph
-	for (int i = 0; i < graph->num_flow_links; i++) {
-		const lfr_flow_link_t *link = &graph->flow_links[i];
-		char_count += fprintf(stream, "link\t");
-		char_count += fprintf(stream, "#%u -> #%u", link->source_node.id, link->target_node.id);
-		char_count += fprintf(stream, "\n");
+	unsigned num_slots = 0;
+	T_FOR_ROWS(index, *table) {
+		lfr_node_t *node = &table->node[index];
+		unsigned n = node->num_inputs + node->num_outputs;
+		memcpy(&slot[num_slots], &table->slot[node->first_slot], sizeof(lfr_slot_t) * n);
+		memcpy(&next_reader[num_slots], &table->next_reader[node->first_slot], sizeof(lfr_slot_ref_t) * n);
+		node->first_slot = num_slots;
+		num_slots += n;
 	}
 
-	return char_count;
+	free(table->slot);
+	free(table->next_reader);
+	table->slot = slot;
+	table->next_reader = next_reader;
+	table->num_slots = num_slots;
+	table->num_unused_slots = 0;
 }
 
 
-//// LFR Node table ////
+/*
+Position of an input slot of the node on the given row (in the slot pool).
+*/
+unsigned lfr_input_slot_(unsigned index, unsigned slot, const lfr_node_table_t *table) {
+	assert(index < table->num_rows && slot < table->node[index].num_inputs);
+	return table->node[index].first_slot + slot;
+}
+
+
+/*
+Position of an output slot of the node on the given row (in the slot pool).
+*/
+unsigned lfr_output_slot_(unsigned index, unsigned slot, const lfr_node_table_t *table) {
+	assert(index < table->num_rows && slot < table->node[index].num_outputs);
+	return table->node[index].first_slot + table->node[index].num_inputs + slot;
+}
+
+
+/*
+Make sure that the id lookup columns can hold the given id.
+*/
+void lfr_reserve_node_table_id_(unsigned id, lfr_node_table_t *table) {
+	if (id < table->id_range) { return; }
+
+	unsigned old_range = table->id_range;
+	table->sparse_id = lfr_grow_sparse_ids_(id, table->sparse_id, &table->id_range);
+	T_RESIZE_COLUMN(table->generation, table->id_range);
+	for (unsigned i = old_range; i < table->id_range; i++) { table->generation[i] = 0; }
+}
+
+
+/**
+Release all memory held by the table, leaving it empty.
+**/
+void lfr_term_node_table(lfr_node_table_t *table) {
+	assert(table);
+	free(table->sparse_id);
+	free(table->generation);
+	free(table->dense_id);
+	free(table->node);
+	free(table->position);
+	free(table->slot);
+	free(table->next_reader);
+	free(table->instruction_at);
+	lfr_term_node_groups_(&table->by_instruction);
+	*table = (lfr_node_table_t) { .next_id = 1 };
+}
+
 
 /**
 Insert a new node at the end of the table.
+
+The node gets as many slots as its instruction declares (the vm may be NULL for core instructions).
 **/
-lfr_node_id_t lfr_insert_node_into_table(lfr_instruction_e inst, lfr_node_table_t *table) {
-	assert(table->num_rows < lfr_node_table_max_rows);
+lfr_node_id_t lfr_insert_node_into_table(lfr_instruction_e inst, const lfr_vm_t *vm, lfr_node_table_t *table) {
+	assert(table);
+	lfr_reserve_node_table_rows(table->num_rows + 1, table);
 
-	// Insert row into sparse table with an unused id
-	while(!table->next_id || T_HAS_ID(*table, (lfr_node_id_t) { table->next_id})) {
+	// Pick the next id not in use (ids only move forward, they never wrap)
+	if (!table->next_id) { table->next_id = 1; }
+	while (table->next_id < table->id_range && (table->generation[table->next_id] & 1)) {
 		table->next_id++;
-		table->next_id %=lfr_node_table_id_range;
 	};
-	int index = T_INSERT_ROW(*table, lfr_node_id_t);
-
-	// Set row data
-	table->node[index].instruction = inst;
-	for (int i = 0; i < lfr_signature_size; i++) {
-		table->node[index].input_data[i].node = (lfr_node_id_t) { 0 };
-		table->node[index].output_data[i] = (lfr_variant_t) { lfr_nil_type, 0};
-	}
+	unsigned id = table->next_id++;
+	lfr_reserve_node_table_id_(id, table);
+
+	// Insert row into sparse table (bumping the generation of the id to "live")
+	unsigned index = table->num_rows++;
+	table->generation[id]++;
+	table->dense_id[index] = (lfr_node_id_t) {id, table->generation[id]};
+	table->sparse_id[id] = index;
+
+	// Set row data (and take slots for it)
+	unsigned num_inputs = lfr_count_instruction_inputs(inst, vm);
+	unsigned num_outputs = lfr_count_instruction_outputs(inst, vm);
+	unsigned first_slot = lfr_take_node_slots_(num_inputs + num_outputs, table);
+	table->node[index] = (lfr_node_t) {inst, first_slot, num_inputs, num_outputs, lfr_normal_priority};
 	table->position[index] = (lfr_vec2_t) { 0, 0};
+	table->instruction_at[index] = lfr_add_to_node_group_(inst, table->dense_id[index], 0, &table->by_instruction);
 
 	return table->dense_id[index];
 }
@@ -941,16 +3375,73 @@ lfr_node_id_t lfr_insert_node_into_table(lfr_instruction_e inst, lfr_node_table_
 /**
 Cnage the id of an existing table row to an unused if.
 
+Returns the new id handle. The old handle is no longer valid afterwards.
+
 Note:
 Although available in the pulblic API, this function moslty has internal usages.
 It is used to change node IDs when loading files so that nodes get the ID definded in the file
 and not just the next free one.
 **/
-void lfr_change_node_id_in_table(lfr_node_id_t old_id, lfr_node_id_t new_id, lfr_node_table_t  *table) {
-	assert(T_HAS_ID(*table, old_id) && !T_HAS_ID(*table, new_id));
+lfr_node_id_t lfr_change_node_id_in_table(lfr_node_id_t old_id, unsigned new_id, lfr_node_table_t  *table) {
+	assert(new_id && T_IS_LIVE(*table, old_id));
+	lfr_reserve_node_table_id_(new_id, table);
+	assert(!(table->generation[new_id] & 1));
+
+	// Data links refer to the old id (so they can not be kept)
 	unsigned index = T_INDEX(*table, old_id);
-	table->dense_id[index] = new_id;
-	table->sparse_id[new_id.id] = index;
+	for (unsigned slot = 0; slot < table->node[index].num_inputs; slot++) {
+		lfr_unlink_input_data_in_table_(index, slot, table);
+	}
+	for (unsigned slot = 0; slot < table->node[index].num_outputs; slot++) {
+		lfr_unlink_output_data_in_table_(index, slot, table);
+	}
+
+	// Retire old id and bring new one to life
+	table->generation[old_id.id]++;
+	table->generation[new_id]++;
+	table->dense_id[index] = (lfr_node_id_t) {new_id, table->generation[new_id]};
+	table->sparse_id[new_id] = index;
+	table->revision++;
+
+	// Re-index (under the new id, in the same place)
+	unsigned inst = table->node[index].instruction;
+	table->by_instruction.nodes[inst][table->instruction_at[index]] = table->dense_id[index];
+	return table->dense_id[index];
+}
+
+
+/**
+Does the given id correspond to a row in the given node table?
+
+Ids of removed nodes are rejected (thanks to the generation of the id).
+**/
+bool lfr_node_table_contains(lfr_node_id_t id, const lfr_node_table_t *table) {
+	return T_IS_LIVE(*table, id);
+}
+
+
+/**
+Get all nodes with the given instruction (returns the number of nodes).
+
+The returned array is only valid until the table is changed.
+**/
+unsigned lfr_get_nodes_with_instruction(unsigned instruction, const lfr_node_table_t *table,
+		const lfr_node_id_t **nodes) {
+	assert(table && nodes);
+	return lfr_get_node_group_(instruction, &table->by_instruction, nodes);
+}
+
+
+/**
+Get the id handle of the node with the given id number (null id if there is no such node).
+
+Usefull when node ids come from outside the program (like script files).
+**/
+lfr_node_id_t lfr_get_node_id(unsigned id, const lfr_node_table_t *table) {
+	if (id >= table->id_range || !(table->generation[id] & 1)) {
+		return (lfr_node_id_t) {0};
+	}
+	return (lfr_node_id_t) {id, table->generation[id]};
 }
 
 
@@ -969,19 +3460,25 @@ lfr_vec2_t lfr_get_node_position(lfr_node_id_t id, const lfr_node_table_t *table
 }
 
 
+/**
+Get scheduling priority of a node in the table.
+**/
+lfr_priority_e lfr_get_node_priority(lfr_node_id_t id, const lfr_node_table_t *table) {
+	return table->node[T_INDEX(*table, id)].priority;
+}
+
+
 /**
 Get (fixed) input value for given node and slot.
 **/
 lfr_variant_t lfr_get_fixed_input_value(
 		lfr_node_id_t id, unsigned slot, const lfr_vm_t *vm, const lfr_node_table_t *table) {
-	assert(slot < lfr_signature_size);
-
 	unsigned index = T_INDEX(*table, id);
+	assert(slot < table->node[index].num_inputs);
 
 	// Graph node fixed value
-	lfr_variant_t graph_data = table->node[index].input_data[slot].fixed_value;
-	if (graph_data.type != lfr_nil_type) {
-		return graph_data;
+	if (table->node[index].fixed & (1u << slot)) {
+		return table->slot[lfr_input_slot_(index, slot, table)].value;
 	}
 
 	// Instructions default value
@@ -996,13 +3493,11 @@ Get the default value for the given node and slot.
 **/
 lfr_variant_t lfr_get_default_output_value(
 		lfr_node_id_t id, unsigned slot, const lfr_vm_t *vm, const lfr_node_table_t *table) {
-	assert(slot < lfr_signature_size);
-
 	unsigned index = T_INDEX(*table, id);
 
 	// Graph node default
-	lfr_variant_t graph_data = table->node[index].output_data[slot];
-	if (graph_data.type != lfr_nil_type) {
+	lfr_variant_t graph_data = table->slot[lfr_output_slot_(index, slot, table)].value;
+	if (lfr_get_variant_type(graph_data) != lfr_nil_type) {
 		return graph_data;
 	}
 
@@ -1021,6 +3516,15 @@ void lfr_set_node_position(lfr_node_id_t id, lfr_vec2_t pos, lfr_node_table_t *t
 }
 
 
+/**
+Set scheduling priority of a node in the table (nodes already queued keep their lane).
+**/
+void lfr_set_node_priority(lfr_node_id_t id, lfr_priority_e priority, lfr_node_table_t *table) {
+	assert(priority < lfr_no_priorities);
+	table->node[T_INDEX(*table, id)].priority = priority;
+}
+
+
 /**
 Set a fixed value as input for the given node and slot.
 
@@ -1028,11 +3532,87 @@ Note:
  Breaks/Clears any previously existing data link.
 **/
 void lfr_set_fixed_input_value(lfr_node_id_t id, unsigned slot, lfr_variant_t value, lfr_node_table_t *table) {
-	assert(slot < lfr_signature_size);
-
 	unsigned index = T_INDEX(*table, id);
-	table->node[index].input_data[slot].node = (lfr_node_id_t) {0};
-	table->node[index].input_data[slot].fixed_value = value;
+	lfr_unlink_input_data_in_table_(index, slot, table);
+	table->slot[lfr_input_slot_(index, slot, table)].value = value;
+	if (lfr_get_variant_type(value) != lfr_nil_type) {
+		table->node[index].fixed |= 1u << slot;
+	} else {
+		table->node[index].fixed &= ~(1u << slot);
+	}
+}
+
+
+/*
+Link output slot of one node to input slot of another (replacing any previous link to the input).
+
+The input slot is added to the readers of the output slot (reverse index).
+*/
+void lfr_link_data_in_table_(lfr_node_id_t out_node, unsigned out_slot, lfr_node_id_t in_node, unsigned in_slot,
+		lfr_node_table_t *table) {
+	unsigned in_index = T_INDEX(*table, in_node);
+	lfr_unlink_input_data_in_table_(in_index, in_slot, table);
+
+	// Set link
+	unsigned in = lfr_input_slot_(in_index, in_slot, table);
+	table->slot[in].link = (lfr_slot_ref_t) {out_node, out_slot};
+	table->node[in_index].linked |= 1u << in_slot;
+
+	// Put first among readers
+	lfr_slot_t *out = &table->slot[lfr_output_slot_(T_INDEX(*table, out_node), out_slot, table)];
+	table->next_reader[in] = out->link;
+	out->link = (lfr_slot_ref_t) {in_node, in_slot};
+}
+
+
+/*
+Unlink input slot on node row from whatever output it is linked to (if any).
+*/
+void lfr_unlink_input_data_in_table_(unsigned in_index, unsigned in_slot, lfr_node_table_t *table) {
+	unsigned in = lfr_input_slot_(in_index, in_slot, table);
+	lfr_slot_ref_t *link = &table->slot[in].link;
+	lfr_slot_ref_t *next = &table->next_reader[in];
+
+	// Remove from readers of linked output
+	if (T_IS_LIVE(*table, link->node)) {
+		lfr_slot_ref_t self = {table->dense_id[in_index], in_slot};
+		lfr_slot_ref_t *ref = &table->slot[lfr_output_slot_(T_INDEX(*table, link->node), link->slot, table)].link;
+		while (T_IS_LIVE(*table, ref->node)) {
+			if (T_SAME_ID(ref->node, self.node) && ref->slot == self.slot) {
+				*ref = *next;
+				break;
+			}
+			ref = &table->next_reader[lfr_input_slot_(T_INDEX(*table, ref->node), ref->slot, table)];
+		}
+	}
+
+	// Clear link
+	*link = (lfr_slot_ref_t) {0};
+	*next = (lfr_slot_ref_t) {0};
+	table->node[in_index].linked &= ~(1u << in_slot);
+	table->revision++;
+}
+
+
+/*
+Unlink output slot on node row from all input slots linked to it.
+*/
+void lfr_unlink_output_data_in_table_(unsigned out_index, unsigned out_slot, lfr_node_table_t *table) {
+	unsigned out = lfr_output_slot_(out_index, out_slot, table);
+
+	// Clear every reader in the list (the list is the readers input slots)
+	lfr_slot_ref_t reader = table->slot[out].link;
+	while (T_IS_LIVE(*table, reader.node)) {
+		unsigned reader_index = T_INDEX(*table, reader.node);
+		unsigned in = lfr_input_slot_(reader_index, reader.slot, table);
+		lfr_slot_ref_t next = table->next_reader[in];
+		table->slot[in].link = (lfr_slot_ref_t) {0};
+		table->next_reader[in] = (lfr_slot_ref_t) {0};
+		table->node[reader_index].linked &= ~(1u << reader.slot);
+		reader = next;
+	}
+	table->slot[out].link = (lfr_slot_ref_t) {0};
+	table->revision++;
 }
 
 
@@ -1040,10 +3620,8 @@ void lfr_set_fixed_input_value(lfr_node_id_t id, unsigned slot, lfr_variant_t va
 Set default date for the given node and slot.
 **/
 void lfr_set_default_output_value(lfr_node_id_t id, unsigned slot, lfr_variant_t value, lfr_node_table_t *table) {
-	assert(slot < lfr_signature_size);
-
 	unsigned index = T_INDEX(*table, id);
-	table->node[index].output_data[slot] = value;
+	table->slot[lfr_output_slot_(index, slot, table)].value = value;
 }
 
 
@@ -1051,17 +3629,42 @@ void lfr_set_default_output_value(lfr_node_id_t id, unsigned slot, lfr_variant_t
 Remove node table row.
 **/
 void lfr_remove_node_from_table(lfr_node_id_t  id, lfr_node_table_t *table) {
-	assert(table && T_HAS_ID(*table, id));
+	assert(table && T_IS_LIVE(*table, id));
+
+	// Drop data links (keeping the reverse index intact)
+	unsigned index = table->sparse_id[id.id];
+	const lfr_node_t *node = &table->node[index];
+	for (unsigned slot = 0; slot < node->num_inputs; slot++) {
+		lfr_unlink_input_data_in_table_(index, slot, table);
+	}
+	for (unsigned slot = 0; slot < node->num_outputs; slot++) {
+		lfr_unlink_output_data_in_table_(index, slot, table);
+	}
+	table->num_unused_slots += node->num_inputs + node->num_outputs;
+
+	// Drop from instruction run (the node moved into its place takes over its position)
+	unsigned at = table->instruction_at[index];
+	lfr_node_id_t moved_node = lfr_remove_from_node_group_(node->instruction, at, &table->by_instruction);
+	if (moved_node.id) { table->instruction_at[T_INDEX(*table, moved_node)] = at; }
+
+	// Retire id (invalidating all handles to it)
+	table->generation[id.id]++;
 
 	// Fast (unordered) delete by moviong last row
-	unsigned index = T_INDEX(*table, id);
 	unsigned moved = --table->num_rows;
 	table->dense_id[index] =  table->dense_id[moved];
 	table->node[index] =  table->node[moved];
 	table->position[index] =  table->position[moved];
+	table->instruction_at[index] = table->instruction_at[moved];
 
 	// Finally update location of moved row
 	table->sparse_id[table->dense_id[index].id] = index;
+	table->revision++;
+
+	// Drop unused slots once they are the majority
+	if (table->num_unused_slots * 2 > table->num_slots) {
+		lfr_compact_node_slots_(table);
+	}
 }
 
 
@@ -1120,6 +3723,23 @@ int lfr_save_node_placements_in_table_to_file(
 }
 
 
+/**
+Print priorities of nodes (that do not have normal priority) onto file stream in a parser friendly (tab separated) format.
+**/
+int lfr_save_node_priorities_in_table_to_file(const lfr_node_table_t *table, FILE * restrict stream) {
+	assert(table && stream);
+	int char_count = 0;
+
+	T_FOR_ROWS(index, *table) {
+		lfr_priority_e priority = table->node[index].priority;
+		if (priority == lfr_normal_priority) { continue; }
+		char_count += fprintf(stream, "priority\t#%u\t%s\n", T_ID(*table, index).id, lfr_get_priority_name(priority));
+	}
+
+	return char_count;
+}
+
+
 /**
 Print data links between nodes onto file stream in a parser friendly (tab separated) format.
 **/
@@ -1129,13 +3749,14 @@ int lfr_save_data_links_in_table_to_file(const lfr_node_table_t* table, FILE * r
 	T_FOR_ROWS(index, *table) {
 		lfr_node_id_t id = T_ID(*table, index);
 		const lfr_node_t *node = &table->node[index];
-		for (int slot = 0; slot < lfr_signature_size; slot++) {
-			if (node->input_data[slot].node.id == 0) { continue; }
+		const lfr_slot_t *slots = &table->slot[node->first_slot];
+		for (int slot = 0; slot < node->num_inputs; slot++) {
+			if (!T_IS_LIVE(*table, slots[slot].link.node)) { continue; }
 
 			char_count += fprintf(stream, "data\t");
 			char_count += fprintf(stream,
 				"#%u:%u -> #%u:%u",
-				node->input_data[slot].node.id, node->input_data[slot].slot,
+				slots[slot].link.node.id, slots[slot].link.slot,
 				id.id, slot);
 			char_count += fprintf(stream, "\n");
 		}
@@ -1154,26 +3775,27 @@ int lfr_save_fixed_values_in_table_to_file(const lfr_node_table_t* table, FILE *
 	T_FOR_ROWS(index, *table) {
 		lfr_node_id_t id = T_ID(*table, index);
 		const lfr_node_t *node = &table->node[index];
-		for (int slot = 0; slot < lfr_signature_size; slot++) {
-			if (node->input_data[slot].node.id != 0) { continue; }
-			if (node->input_data[slot].fixed_value.type == lfr_nil_type) { continue; }
+		const lfr_slot_t *slots = &table->slot[node->first_slot];
+		for (int slot = 0; slot < node->num_inputs; slot++) {
+			if (T_IS_LIVE(*table, slots[slot].link.node)) { continue; }
+			if (lfr_get_variant_type(slots[slot].value) == lfr_nil_type) { continue; }
 
 			// Print 'value' and slot
 			char_count += fprintf(stream, "value\t");
 			char_count += fprintf(stream, "#%u:%u =\t", id.id, slot);
 
 			// Print type specific string to stream
-			lfr_variant_t var = node->input_data[slot].fixed_value;
-			if (var.type == lfr_float_type) {
+			lfr_variant_t var = slots[slot].value;
+			lfr_variant_type_e type = lfr_get_variant_type(var);
+			if (type == lfr_float_type) {
 				char_count += fprintf(stream, "float %f", var.float_value);
-			} else if (var.type == lfr_bool_type) {
+			} else if (type == lfr_bool_type) {
 				char_count += fprintf(stream, "bool %c", var.bool_value ? 't' : 'f');
-			} else if (var.type == lfr_int_type) {
+			} else if (type == lfr_int_type) {
 				char_count += fprintf(stream, "int %d", var.int_value);
-			} else if (var.type == lfr_vec2_type) {
-				char_count += fprintf(stream,
-					"vec2 (%f, %f)",
-					var.vec2_value.x, var.vec2_value.y);
+			} else if (type == lfr_vec2_type) {
+				lfr_vec2_t vec2 = lfr_to_vec2(var);
+				char_count += fprintf(stream, "vec2 (%f, %f)", vec2.x, vec2.y);
 			} else {
 				char_count += fprintf(stream, "???");
 				fprintf(stderr,
@@ -1225,8 +3847,8 @@ lfr_result_e lfr_tick_proc(lfr_variant_t input[], lfr_variant_t output[], lfr_pr
 
 lfr_result_e lfr_randomize_number_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
 	// Assign random float value
-	output[0].type = lfr_float_type;
-	output[0].float_value = (float)(rand())/(float)(RAND_MAX);
+	// (from the graph state, so that states are independent of each other and of threads)
+	output[0] = lfr_float(lfr_random_float_(&env->graph_state->random_state));
 	return lfr_continue;
 }
 
@@ -1238,9 +3860,9 @@ Combine floats into a sum.
 **/
 lfr_result_e lfr_add_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
 	// Sum all floats
-	lfr_variant_t result = {lfr_float_type, .float_value = 0};
-	for (int i = 0; i < lfr_signature_size; i++) {
-		if (input[i].type == lfr_float_type) {
+	lfr_variant_t result = lfr_float(0);
+	for (int i = 0; i < 2; i++) {
+		if (lfr_get_variant_type(input[i]) == lfr_float_type) {
 			result.float_value += input[i].float_value;
 		}
 	}
@@ -1256,7 +3878,7 @@ Subtract - Get the difference between two floats.
 **/
 lfr_result_e lfr_sub_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
 	// Subtract the second float from the first
-	if (input[0].type == lfr_float_type && input[1].type == lfr_float_type) {
+	if (lfr_get_variant_type(input[0]) == lfr_float_type && lfr_get_variant_type(input[1]) == lfr_float_type) {
 		output[0] = lfr_float(input[0].float_value - input[1].float_value);
 	} else {
 		assert(0 && "Not two floats");
@@ -1270,9 +3892,9 @@ Multiply - Get the procuct of two (or more) floats
 **/
 lfr_result_e lfr_mul_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
 	// Multiply all floats
-	lfr_variant_t result = {lfr_float_type, .float_value = 1};
-	for (int i = 0; i < lfr_signature_size; i++) {
-		if (input[i].type == lfr_float_type) {
+	lfr_variant_t result = lfr_float(1);
+	for (int i = 0; i < 2; i++) {
+		if (lfr_get_variant_type(input[i]) == lfr_float_type) {
 			result.float_value *= input[i].float_value;
 		}
 	}
@@ -1287,9 +3909,9 @@ lfr_result_e lfr_mul_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_pr
 Calculate the distance between two vec2.
 **/
 lfr_result_e lfr_distance_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
-	if (input[0].type == lfr_vec2_type && input[1].type == lfr_vec2_type) {
-		lfr_vec2_t a = input[0].vec2_value;
-		lfr_vec2_t b = input[1].vec2_value;
+	if (lfr_get_variant_type(input[0]) == lfr_vec2_type && lfr_get_variant_type(input[1]) == lfr_vec2_type) {
+		lfr_vec2_t a = lfr_to_vec2(input[0]);
+		lfr_vec2_t b = lfr_to_vec2(input[1]);
 		float dx = a.x - b.x, dy = a.y - b.y;
 		float l = sqrtf(dx * dx + dy * dy);
 		output[0] = lfr_float(l);
@@ -1306,12 +3928,12 @@ lfr_result_e lfr_distance_proc( lfr_variant_t input[], lfr_variant_t output[], l
 Print value to stdout.
 **/
 lfr_result_e lfr_print_value_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
-	switch(input[0].type) {
+	switch(lfr_get_variant_type(input[0])) {
 	case lfr_nil_type: { printf("nil\n");} break;
 	case lfr_bool_type: { printf("%s", input[0].bool_value ? "true" : "false");} break;
 	case lfr_int_type: { printf("%d", input[0].int_value); } break;
 	case lfr_float_type: { printf("%f\n", input[0].float_value); } break;
-	case lfr_vec2_type: { printf("(%f,%f)\n", input[0].vec2_value.x, input[0].vec2_value.y); } break;
+	case lfr_vec2_type: { printf("(%f,%f)\n", lfr_to_vec2(input[0]).x, lfr_to_vec2(input[0]).y); } break;
 	case lfr_no_core_types: { assert(0 && "Not a type"); } break;
 	}
 	return lfr_continue;
@@ -1324,7 +3946,7 @@ Instruction: `if_between`
 Only continue if value is within permitted range
 **/
 lfr_result_e lfr_if_between_proc( lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
-	if (input[0].type == lfr_float_type) {
+	if (lfr_get_variant_type(input[0]) == lfr_float_type) {
 		float val = input[0].float_value;
 		float min = lfr_to_float(input[1]);
 		float max = lfr_to_float(input[2]);
@@ -1367,20 +3989,313 @@ Instruction: `delay`
 Waits untill the given ammount of time has passed.
 **/
 lfr_result_e lfr_delay_proc(lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
-	// Store limit in milliseconds if this is the first iteration
+	// Sleep until the time has passed if this is the first iteration
 	if (env->work == 0) {
-		float limit = env->time + lfr_to_float(input[0]);
-		env->work = (int)limit * 1000;
-		return lfr_wait;
+		env->work = 1;
+		env->wake_time = env->clock + lfr_seconds_to_clock_(lfr_to_float(input[0]));
+		return lfr_sleep;
+	}
+
+	// Woken up - Continue flow
+	return lfr_continue;
+}
+
+
+/**
+Instruction: `await_signal`
+
+Waits untill the given signal is raised (see `lfr_raise_signal()`).
+**/
+lfr_result_e lfr_await_signal_proc(lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
+	// Not a signal
+	int signal = lfr_to_int(input[0]);
+	if (signal < 0 || signal >= lfr_max_signals) {
+		return lfr_halt;
+	}
+
+	// Wait for the signal if this is the first iteration
+	if (env->work == 0) {
+		env->work = 1;
+		env->signal = signal;
+		return lfr_await;
+	}
+
+	// Woken up - Continue flow
+	return lfr_continue;
+}
+
+
+/**
+Instruction: `send_signal`
+
+Wakes up all nodes waiting for the given signal (in the same graph state).
+**/
+lfr_result_e lfr_send_signal_proc(lfr_variant_t input[], lfr_variant_t output[], lfr_process_env_i *env) {
+	int signal = lfr_to_int(input[0]);
+	if (signal >= 0 && signal < lfr_max_signals) {
+		lfr_raise_signal(signal, env->graph_state);
+	}
+	return lfr_continue;
+}
+
+
+//// LFR Math kernels ////
+
+/*
+Float column kernels used by the batched math instructions.
+
+Every level computes the exact same (bit for bit) results, since each lane does the same
+IEEE operations in the same order as the scalar code (and no fused multiply-add is used).
+*/
+typedef struct lfr_float_kernels_ {
+	void (*add)(float *acc, const float *x, unsigned n);
+	void (*mul)(float *acc, const float *x, unsigned n);
+	void (*sub)(float *out, const float *a, const float *b, unsigned n);
+	void (*length)(float *out, const float *x, const float *y, unsigned n);
+} lfr_float_kernels_t;
+
+/* Level supported by build and CPU (`lfr_no_simd_levels` until detected) and highest level allowed. */
+#ifdef LFR_THREADS
+static atomic_int lfr_simd_detected_ = lfr_no_simd_levels, lfr_simd_limit_ = lfr_no_simd_levels;
+#else
+static lfr_simd_e lfr_simd_detected_ = lfr_no_simd_levels, lfr_simd_limit_ = lfr_no_simd_levels;
+#endif
+
+void lfr_add_floats_(float *acc, const float *x, unsigned n) {
+	for (unsigned i = 0; i < n; i++) { acc[i] += x[i]; }
+}
+
+void lfr_mul_floats_(float *acc, const float *x, unsigned n) {
+	for (unsigned i = 0; i < n; i++) { acc[i] *= x[i]; }
+}
+
+void lfr_sub_floats_(float *out, const float *a, const float *b, unsigned n) {
+	for (unsigned i = 0; i < n; i++) { out[i] = a[i] - b[i]; }
+}
+
+void lfr_length_floats_(float *out, const float *x, const float *y, unsigned n) {
+	for (unsigned i = 0; i < n; i++) { out[i] = sqrtf(x[i] * x[i] + y[i] * y[i]); }
+}
+
+static const lfr_float_kernels_t lfr_scalar_kernels_ = {
+	lfr_add_floats_, lfr_mul_floats_, lfr_sub_floats_, lfr_length_floats_
+};
+
+#if defined(LFR_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LFR_X86_SIMD_
+
+/* Define kernels for one instruction set (`W` floats per vector, remainder done in scalar). */
+#define LFR_DEFINE_KERNELS_(S, T, W, V, LOAD, STORE, ADD, SUB, MUL, SQRT) \
+	__attribute__((target(T))) void lfr_add_floats_##S##_(float *acc, const float *x, unsigned n) { \
+		unsigned i = 0; \
+		for (; i + W <= n; i += W) { STORE(acc + i, ADD(LOAD(acc + i), LOAD(x + i))); } \
+		lfr_add_floats_(acc + i, x + i, n - i); \
+	} \
+	__attribute__((target(T))) void lfr_mul_floats_##S##_(float *acc, const float *x, unsigned n) { \
+		unsigned i = 0; \
+		for (; i + W <= n; i += W) { STORE(acc + i, MUL(LOAD(acc + i), LOAD(x + i))); } \
+		lfr_mul_floats_(acc + i, x + i, n - i); \
+	} \
+	__attribute__((target(T))) void lfr_sub_floats_##S##_(float *out, const float *a, const float *b, unsigned n) { \
+		unsigned i = 0; \
+		for (; i + W <= n; i += W) { STORE(out + i, SUB(LOAD(a + i), LOAD(b + i))); } \
+		lfr_sub_floats_(out + i, a + i, b + i, n - i); \
+	} \
+	__attribute__((target(T))) void lfr_length_floats_##S##_(float *out, const float *x, const float *y, \
+			unsigned n) { \
+		unsigned i = 0; \
+		for (; i + W <= n; i += W) { \
+			V x_i = LOAD(x + i), y_i = LOAD(y + i); \
+			STORE(out + i, SQRT(ADD(MUL(x_i, x_i), MUL(y_i, y_i)))); \
+		} \
+		lfr_length_floats_(out + i, x + i, y + i, n - i); \
+	} \
+	static const lfr_float_kernels_t lfr_##S##_kernels_ = { \
+		lfr_add_floats_##S##_, lfr_mul_floats_##S##_, lfr_sub_floats_##S##_, lfr_length_floats_##S##_ \
+	};
+
+LFR_DEFINE_KERNELS_(sse2, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps,
+	_mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_sqrt_ps)
+LFR_DEFINE_KERNELS_(avx2, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps,
+	_mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_sqrt_ps)
+#undef LFR_DEFINE_KERNELS_
+#endif
+
+
+/*
+Detect the level of SIMD supported by both build and CPU (only the first call does any work).
+
+Called by `lfr_init_world()`, so the CPU is not queried again while worlds are stepped.
+*/
+lfr_simd_e lfr_detect_simd_level_(void) {
+	lfr_simd_e level = lfr_simd_detected_;
+	if (level == lfr_no_simd_levels) {
+		level = lfr_simd_none;
+#ifdef LFR_X86_SIMD_
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2")) { level = lfr_simd_sse2; }
+		if (__builtin_cpu_supports("avx2")) { level = lfr_simd_avx2; }
+#endif
+		lfr_simd_detected_ = level; // Racing threads store the same level
+	}
+	return level;
+}
+
+
+/**
+Get the best level of SIMD that is supported (by both build and CPU) and allowed.
+**/
+lfr_simd_e lfr_get_simd_level(void) {
+	lfr_simd_e level = lfr_detect_simd_level_(), limit = lfr_simd_limit_;
+	return (level < limit ? level : limit);
+}
+
+
+/**
+Do not use SIMD levels above the given one (for comparing levels, or working around platform issues).
+**/
+void lfr_limit_simd_level(lfr_simd_e level) {
+	assert(level < lfr_no_simd_levels);
+	lfr_simd_limit_ = level;
+}
+
+
+/*
+Get kernels for best SIMD level available (selected at runtime).
+*/
+const lfr_float_kernels_t* lfr_get_float_kernels_(void) {
+	switch (lfr_get_simd_level()) {
+#ifdef LFR_X86_SIMD_
+	case lfr_simd_avx2: return &lfr_avx2_kernels_;
+	case lfr_simd_sse2: return &lfr_sse2_kernels_;
+#endif
+	default: return &lfr_scalar_kernels_;
+	}
+}
+
+
+/* Number of batch values processed per chunk (so columns fit on the stack). */
+enum { lfr_kernel_chunk_size_ = 256 };
+
+/* Copy float values of a column into a float array (other types get the given value). */
+void lfr_extract_floats_(const lfr_variant_t *column, float other, unsigned n, float *out) {
+	for (unsigned i = 0; i < n; i++) {
+		out[i] = (lfr_get_variant_type(column[i]) == lfr_float_type ? column[i].float_value : other);
+	}
+}
+
+
+/*
+Batched `add` (see `lfr_add_proc()`).
+
+Non float inputs are added as zero (same result as skipping them).
+*/
+void lfr_add_batch(lfr_batch_t *batch) {
+	const lfr_float_kernels_t *kernels = lfr_get_float_kernels_();
+	float sum[lfr_kernel_chunk_size_], x[lfr_kernel_chunk_size_];
+	for (unsigned first = 0; first < batch->size; first += lfr_kernel_chunk_size_) {
+		unsigned n = batch->size - first;
+		if (n > lfr_kernel_chunk_size_) { n = lfr_kernel_chunk_size_; }
+
+		for (unsigned k = 0; k < n; k++) { sum[k] = 0.f; }
+		for (int i = 0; i < 2; i++) {
+			lfr_extract_floats_(batch->input[i] + first, 0.f, n, x);
+			kernels->add(sum, x, n);
+		}
+		for (unsigned k = 0; k < n; k++) {
+			batch->output[0][first + k] = lfr_float(sum[k]);
+			batch->result[first + k] = lfr_continue;
+		}
+	}
+}
+
+
+/*
+Batched `sub` (see `lfr_sub_proc()`).
+*/
+void lfr_sub_batch(lfr_batch_t *batch) {
+	const lfr_float_kernels_t *kernels = lfr_get_float_kernels_();
+	float a[lfr_kernel_chunk_size_], b[lfr_kernel_chunk_size_], diff[lfr_kernel_chunk_size_];
+	for (unsigned first = 0; first < batch->size; first += lfr_kernel_chunk_size_) {
+		unsigned n = batch->size - first;
+		if (n > lfr_kernel_chunk_size_) { n = lfr_kernel_chunk_size_; }
+
+		for (unsigned k = 0; k < n; k++) {
+			assert(lfr_get_variant_type(batch->input[0][first + k]) == lfr_float_type
+				&& lfr_get_variant_type(batch->input[1][first + k]) == lfr_float_type && "Not two floats");
+		}
+		lfr_extract_floats_(batch->input[0] + first, 0.f, n, a);
+		lfr_extract_floats_(batch->input[1] + first, 0.f, n, b);
+		kernels->sub(diff, a, b, n);
+		for (unsigned k = 0; k < n; k++) {
+			batch->output[0][first + k] = lfr_float(diff[k]);
+			batch->result[first + k] = lfr_continue;
+		}
 	}
+}
+
 
-	// Continue flow if the time limit has passed
-	if (env->work < env->time * 1000) {
-		return lfr_continue;
+/*
+Batched `mul` (see `lfr_mul_proc()`).
+
+Non float inputs are multiplied as one (same result as skipping them).
+*/
+void lfr_mul_batch(lfr_batch_t *batch) {
+	const lfr_float_kernels_t *kernels = lfr_get_float_kernels_();
+	float prod[lfr_kernel_chunk_size_], x[lfr_kernel_chunk_size_];
+	for (unsigned first = 0; first < batch->size; first += lfr_kernel_chunk_size_) {
+		unsigned n = batch->size - first;
+		if (n > lfr_kernel_chunk_size_) { n = lfr_kernel_chunk_size_; }
+
+		for (unsigned k = 0; k < n; k++) { prod[k] = 1.f; }
+		for (int i = 0; i < 2; i++) {
+			lfr_extract_floats_(batch->input[i] + first, 1.f, n, x);
+			kernels->mul(prod, x, n);
+		}
+		for (unsigned k = 0; k < n; k++) {
+			batch->output[0][first + k] = lfr_float(prod[k]);
+			batch->result[first + k] = lfr_continue;
+		}
 	}
+}
+
+
+/*
+Batched `distance` (see `lfr_distance_proc()`).
+
+The differences are taken while splitting the vec2 columns (same operations as the scalar code),
+so only the length is left to the kernel.
+*/
+void lfr_distance_batch(lfr_batch_t *batch) {
+	const lfr_float_kernels_t *kernels = lfr_get_float_kernels_();
+	float dx[lfr_kernel_chunk_size_], dy[lfr_kernel_chunk_size_], dist[lfr_kernel_chunk_size_];
+	bool valid[lfr_kernel_chunk_size_];
+	for (unsigned first = 0; first < batch->size; first += lfr_kernel_chunk_size_) {
+		unsigned n = batch->size - first;
+		if (n > lfr_kernel_chunk_size_) { n = lfr_kernel_chunk_size_; }
+
+		// Split vec2 columns into x and y differences (only vec2 pairs get a result)
+		const lfr_variant_t *a = batch->input[0] + first, *b = batch->input[1] + first;
+		for (unsigned k = 0; k < n; k++) {
+			valid[k] = lfr_get_variant_type(a[k]) == lfr_vec2_type && lfr_get_variant_type(b[k]) == lfr_vec2_type;
+			lfr_vec2_t a_k = lfr_to_vec2(a[k]), b_k = lfr_to_vec2(b[k]);
+			dx[k] = a_k.x - b_k.x;
+			dy[k] = a_k.y - b_k.y;
+		}
+		kernels->length(dist, dx, dy, n);
 
-	// Otherwise wait some more
-	return lfr_wait;
+		for (unsigned k = 0; k < n; k++) {
+			if (valid[k]) {
+				batch->output[0][first + k] = lfr_float(dist[k]);
+			} else {
+				lfr_process_env_i *env = &batch->env[first + k];
+				fprintf(stderr,
+					"Distance node [#%u|%u] recieved an unsuported input type combination.",
+					env->node_id.id, lfr_get_node_index(env->node_id, &env->graph->nodes));
+			}
+			batch->result[first + k] = lfr_continue;
+		}
+	}
 }
 
 
@@ -1391,51 +4306,74 @@ Note:
  Order is expected to match lfr_instruction_e above.
 **/
 static const lfr_instruction_def_t lfr_core_instructions_[lfr_no_core_instructions] = {
-	{"print_own_id", lfr_print_own_id_proc, {}, {}},
+	{"print_own_id", lfr_print_own_id_proc, {}, {}, .flags = lfr_writes_host},
 	{"tick", lfr_tick_proc, {}, {}},
 	{"randomize_number", lfr_randomize_number_proc,
 		{},
-		{{"RND float",  {lfr_float_type, .float_value = 0 }}}
+		{{"RND float",  LFR_FLOAT(0)}},
+		.flags = lfr_nondeterministic,
 	},
 	{"add", lfr_add_proc,
-		{{"A", {lfr_float_type, .float_value = 0}}, {"B", {lfr_float_type, .float_value = 0}}},
-		{{"SUM", {lfr_float_type, .float_value = 0}}}
+		{{"A", LFR_FLOAT(0)}, {"B", LFR_FLOAT(0)}},
+		{{"SUM", LFR_FLOAT(0)}},
+		lfr_add_batch,
+		.flags = lfr_pure,
 	},
 	{"sub", lfr_sub_proc,
-		{{"A", {lfr_float_type, .float_value = 0}}, {"B", {lfr_float_type, .float_value = 0}}},
-		{{"DIFF", {lfr_float_type, .float_value = 0}}}
+		{{"A", LFR_FLOAT(0)}, {"B", LFR_FLOAT(0)}},
+		{{"DIFF", LFR_FLOAT(0)}},
+		lfr_sub_batch,
+		.flags = lfr_pure,
 	},
 	{"mul", lfr_mul_proc,
-		{{"A", {lfr_float_type, .float_value = 0}}, {"B", {lfr_float_type, .float_value = 0}}},
-		{{"PROD", {lfr_float_type, .float_value = 0}}}
+		{{"A", LFR_FLOAT(0)}, {"B", LFR_FLOAT(0)}},
+		{{"PROD", LFR_FLOAT(0)}},
+		lfr_mul_batch,
+		.flags = lfr_pure,
 	},
 	{"distance", lfr_distance_proc,
 		{
-			{"A", {lfr_vec2_type, .vec2_value = LFR_VEC2_ORIGO}},
-			{"B", {lfr_vec2_type, .vec2_value = LFR_VEC2_ORIGO}}
+			{"A", LFR_ORIGO},
+			{"B", LFR_ORIGO}
 		},
-		{{"DIST", {lfr_float_type, .float_value = 0}}}
+		{{"DIST", LFR_FLOAT(0)}},
+		lfr_distance_batch,
+		.flags = lfr_pure,
 	},
 	{"print_value", lfr_print_value_proc,
-		{{"VAL", {lfr_float_type, .float_value = 0}}},
-		{}
+		{{"VAL", LFR_FLOAT(0)}},
+		{},
+		.flags = lfr_writes_host,
 	},
 	// Flow control
 	{"if_between", lfr_if_between_proc,
 		{
-			{"VAL", {lfr_float_type, .float_value = 0}},
-			{"MIN", {lfr_float_type, .float_value = 0}},
-			{"MAX", {lfr_float_type, .float_value = 0}}
+			{"VAL", LFR_FLOAT(0)},
+			{"MIN", LFR_FLOAT(0)},
+			{"MAX", LFR_FLOAT(0)}
 		},
-		{}
+		{},
+		.flags = lfr_yields,
 	},
 	{"repeat", lfr_repeat_proc,
-		{{"TIMES", {lfr_int_type, .int_value = 0}}},
-		{}
+		{{"TIMES", LFR_INT(0)}},
+		{},
+		.flags = lfr_yields,
 	},
 	{"delay", lfr_delay_proc,
 		{{"TIME", LFR_FLOAT(0.f)}},
-		{}
+		{},
+		.flags = lfr_yields,
+	},
+	{"await_signal", lfr_await_signal_proc,
+		{{"SIGNAL", LFR_INT(0)}},
+		{},
+		.flags = lfr_yields,
+	},
+	{"send_signal", lfr_send_signal_proc,
+		{{"SIGNAL", LFR_INT(0)}},
+		{},
+		.flags = lfr_yields,
 	},
 };
 
@@ -1446,14 +4384,7 @@ static const lfr_instruction_def_t lfr_core_instructions_[lfr_no_core_instructio
 Count number of *inputs* in this instructions signature.
 **/
 unsigned lfr_count_instruction_inputs(unsigned instruction, const lfr_vm_t *vm) {
-	unsigned count = 0;
-	const lfr_instruction_def_t *def = lfr_get_instruction(instruction, vm);
-	for (int slot = 0; slot < lfr_signature_size; slot++) {
-		if (def->input_signature[slot].data.type != lfr_nil_type) {
-			count++;
-		}
-	}
-	return count;
+	return lfr_count_signature_slots_(lfr_get_instruction(instruction, vm)->input_signature);
 }
 
 
@@ -1461,11 +4392,18 @@ unsigned lfr_count_instruction_inputs(unsigned instruction, const lfr_vm_t *vm)
 Count number of *outputs* in this instructions signature.
 **/
 unsigned lfr_count_instruction_outputs(unsigned instruction, const lfr_vm_t *vm) {
+	return lfr_count_signature_slots_(lfr_get_instruction(instruction, vm)->output_signature);
+}
+
+
+/*
+Count declared slots (up to and including the last one with a name or a default value).
+*/
+unsigned lfr_count_signature_slots_(const lfr_slot_def_t signature[]) {
 	unsigned count = 0;
-	const lfr_instruction_def_t *def = lfr_get_instruction(instruction, vm);
-	for (int slot = 0; slot < lfr_signature_size; slot++) {
-		if (def->output_signature[slot].data.type != lfr_nil_type) {
-			count++;
+	for (unsigned slot = 0; slot < lfr_signature_size; slot++) {
+		if (signature[slot].name || lfr_get_variant_type(signature[slot].data) != lfr_nil_type) {
+			count = slot + 1;
 		}
 	}
 	return count;
@@ -1503,6 +4441,16 @@ const lfr_instruction_def_t* lfr_get_custom_instruction(lfr_instruction_e inst,
 }
 
 
+/**
+Get name of scheduling priority (as used in saved graphs).
+**/
+const char* lfr_get_priority_name(lfr_priority_e priority) {
+	static const char *names[lfr_no_priorities] = {"critical", "high", "normal", "low"};
+	assert(priority < lfr_no_priorities);
+	return names[priority];
+}
+
+
 /**
 Get name of (core or custom) instruction.
 **/
@@ -1560,53 +4508,635 @@ lfr_instruction_e lfr_find_instruction_from_name(const char* name, const lfr_vm_
 
 
 /**
-Insert a row for the given id into the auxiliary node state table.
+Make sure that the node state table has room for (at least) the given number of rows.
+**/
+void lfr_reserve_node_state_table_rows(unsigned num_rows, lfr_node_state_table_t *table) {
+	assert(table);
+	if (num_rows <= table->max_rows) { return; }
+
+	table->max_rows = lfr_grow_capacity_(table->max_rows, num_rows);
+	T_RESIZE_COLUMN(table->node_state, table->max_rows);
+	T_RESIZE_COLUMN(table->has_run, (table->max_rows + 31) / 32);
+}
+
+
+/**
+Release memory reserved for node state rows (and values) that are not in use.
+**/
+void lfr_shrink_node_state_table(lfr_node_state_table_t *table) {
+	assert(table);
+	if (table->num_values < table->max_values) {
+		table->max_values = table->num_values;
+		T_RESIZE_COLUMN(table->value, table->max_values);
+		T_RESIZE_COLUMN(table->source, table->max_values);
+	}
+	if (table->num_rows == table->max_rows) { return; }
+
+	table->max_rows = table->num_rows;
+	T_RESIZE_COLUMN(table->node_state, table->max_rows);
+	T_RESIZE_COLUMN(table->has_run, (table->max_rows + 31) / 32);
+}
+
+
+/**
+Release all memory held by the node state table, leaving it empty.
+**/
+void lfr_term_node_state_table(lfr_node_state_table_t *table) {
+	assert(table);
+	free(table->node_state);
+	free(table->has_run);
+	free(table->value);
+	free(table->source);
+	*table = (lfr_node_state_table_t) {0};
+}
+
+
+/**
+Get the row of the given node in the node state table, giving it values if it has none.
+
+Rows are the same as in the node table (catching up with the node table first if it has changed).
+New rows start out with the default output values of the node
+(inputs are bound when the node is processed).
 **/
-unsigned lfr_insert_node_state_at(lfr_node_id_t id, const lfr_node_table_t * nt, lfr_node_state_table_t *st) {
+unsigned lfr_insert_node_state_at(lfr_node_id_t id, const lfr_vm_t *vm,
+		const lfr_node_table_t * nt, lfr_node_state_table_t *st) {
 	assert(nt && st);
-	assert(T_HAS_ID(*nt, id));
+	assert(T_IS_LIVE(*nt, id));
 
-	// Reuse existing row or create new
-	unsigned index;
-	if (T_HAS_ID(*st, id)) {
-		index = T_INDEX(*st, id);
-	} else {
-		assert(st->num_rows < lfr_node_table_max_rows);
-		index = st->num_rows++;
-		st->dense_id[index] = id;
-		st->sparse_id[id.id] = index;
+	// Reuse existing values (rows are only moved when the node table has changed)
+	unsigned index = T_INDEX(*nt, id);
+	if (st->revision == nt->revision && index < st->num_rows && T_SAME_ID(st->node_state[index].node, id)) {
+		return index;
+	}
+	lfr_sync_node_state_rows_(nt, st);
+	lfr_extend_node_state_rows_(nt->num_rows, st);
+
+	// Take new values at the end of the value pool (unless moved into place)
+	if (!T_SAME_ID(st->node_state[index].node, id)) {
+		const lfr_node_t *node = &nt->node[index];
+		unsigned num_values = node->num_outputs + node->num_inputs;
+		if (st->num_values + num_values > st->max_values) {
+			st->max_values = lfr_grow_capacity_(st->max_values, st->num_values + num_values);
+			T_RESIZE_COLUMN(st->value, st->max_values);
+			T_RESIZE_COLUMN(st->source, st->max_values);
+		}
+		st->node_state[index] = (lfr_node_state_t) {
+			id, st->num_values, node->num_outputs, node->num_inputs, nt->revision - 1 // (not bound yet)
+		};
+		for (unsigned slot = 0; slot < node->num_outputs; slot++) {
+			st->value[st->num_values + slot] = lfr_get_default_output_value(id, slot, vm, nt);
+		}
+		st->num_values += num_values;
 	}
 
 	return index;
 }
 
+
+/*
+Move node state rows to the (current) rows of their nodes in the node table, dropping rows of removed nodes.
+
+Values are compacted into new arrays in the same go, so every input has to be bound again.
+*/
+void lfr_sync_node_state_rows_(const lfr_node_table_t *nt, lfr_node_state_table_t *st) {
+	if (st->revision == nt->revision) { return; }
+
+	lfr_node_state_table_t synced = { .revision = nt->revision, .max_values = st->num_values };
+	lfr_extend_node_state_rows_(nt->num_rows, &synced);
+	T_RESIZE_COLUMN(synced.value, synced.max_values);
+	T_RESIZE_COLUMN(synced.source, synced.max_values);
+	for (unsigned row = 0; row < st->num_rows; row++) {
+		const lfr_node_state_t *node_state = &st->node_state[row];
+		if (!T_IS_LIVE(*nt, node_state->node)) { continue; }
+
+		unsigned index = T_INDEX(*nt, node_state->node);
+		unsigned num_values = node_state->num_outputs + node_state->num_inputs;
+		synced.node_state[index] = *node_state;
+		synced.node_state[index].first_value = synced.num_values;
+		synced.node_state[index].revision = nt->revision - 1;
+		memcpy(&synced.value[synced.num_values], &st->value[node_state->first_value],
+			sizeof(lfr_variant_t) * num_values);
+		synced.num_values += num_values;
+		if (st->has_run[row / 32] & (1u << row % 32)) {
+			synced.has_run[index / 32] |= 1u << index % 32;
+		}
+	}
+
+	lfr_term_node_state_table(st);
+	*st = synced;
+}
+
+
+/*
+Make the node state table cover (at least) the given number of rows.
+
+New rows have no values and have not run.
+*/
+void lfr_extend_node_state_rows_(unsigned num_rows, lfr_node_state_table_t *st) {
+	if (num_rows <= st->num_rows) { return; }
+
+	lfr_reserve_node_state_table_rows(num_rows, st);
+	for (unsigned row = st->num_rows; row < num_rows; row++) {
+		st->node_state[row] = (lfr_node_state_t) {0};
+		st->has_run[row / 32] &= ~(1u << row % 32);
+	}
+	st->num_rows = num_rows;
+}
+
+
+/*
+Find the node state row of the given node (UINT_MAX if it has no values).
+
+Rows that have not caught up with the node table yet are searched for,
+starting with the row the node has in the node table.
+The table is only read, rows catch up when the state is stepped (see `lfr_sync_node_state_rows_()`).
+*/
+unsigned lfr_find_node_state_(lfr_node_id_t id, const lfr_node_table_t *nt, const lfr_node_state_table_t *st) {
+	if (!T_IS_LIVE(*nt, id)) { return UINT_MAX; }
+
+	unsigned index = T_INDEX(*nt, id);
+	if (index < st->num_rows && T_SAME_ID(st->node_state[index].node, id)) { return index; }
+	if (st->revision == nt->revision) { return UINT_MAX; }
+
+	for (unsigned row = 0; row < st->num_rows; row++) {
+		if (T_SAME_ID(st->node_state[row].node, id)) { return row; }
+	}
+	return UINT_MAX;
+}
+
+
+/**
+Has the node with the given id been processed (with the given node state table)?
+**/
+bool lfr_node_state_table_contains(lfr_node_id_t id, const lfr_node_table_t *nt, const lfr_node_state_table_t *st) {
+	assert(nt && st);
+	unsigned row = lfr_find_node_state_(id, nt, st);
+	return row != UINT_MAX && (st->has_run[row / 32] & (1u << row % 32));
+}
+
+
+//// LFR Node queue ////
+
+/* Position of the n:th entry (counting from head) in the ring buffer. */
+#define Q_INDEX(q, n) \
+	(((q).head + (n)) & ((q).max_entries - 1))
+
+
+/**
+Add a node last in the queue, growing the queue if it is full.
+
+Once the queue has reached its limit (if any) the queue policy decides what happens.
+Returns false if the entry was refused (blocked or coalesced).
+**/
+bool lfr_push_node_queue(lfr_queued_node_t entry, lfr_node_queue_t *queue) {
+	return lfr_push_node_queue_(entry, true, queue);
+}
+
+
+/*
+Push to queue, optionally ignoring the `block` policy (for work already in flight).
+*/
+bool lfr_push_node_queue_(lfr_queued_node_t entry, bool may_block, lfr_node_queue_t *queue) {
+	assert(queue && queue->policy < lfr_no_queue_policies);
+
+	// Apply overflow policy
+	if (queue->limit && queue->num_entries >= queue->limit) {
+		switch (queue->policy) {
+		case lfr_queue_grow: break;
+		case lfr_queue_block: {
+			if (may_block) {
+				queue->num_blocked++;
+				return false;
+			}
+		} break;
+		case lfr_queue_coalesce: {
+			for (unsigned i = 0; i < queue->num_entries; i++) {
+				lfr_queued_node_t queued = queue->entries[Q_INDEX(*queue, i)];
+				if (T_SAME_ID(queued.node, entry.node) && queued.work == entry.work) {
+					queue->num_coalesced++;
+					return false;
+				}
+			}
+		} break;
+		case lfr_queue_drop_oldest: {
+			lfr_queued_node_t dropped;
+			while (queue->num_entries >= queue->limit && lfr_pop_node_queue(queue, &dropped)) {
+				queue->num_dropped++;
+			}
+		} break;
+		case lfr_no_queue_policies: assert(0); break;
+		}
+	}
+
+	// Double capacity, then move wrapped entries (the ones before head) to after the old end
+	if (queue->num_entries == queue->max_entries) {
+		unsigned old_max = queue->max_entries;
+		queue->max_entries = lfr_grow_capacity_(old_max, old_max + 1);
+		T_RESIZE_COLUMN(queue->entries, queue->max_entries);
+		for (unsigned i = 0; i < queue->head; i++) {
+			queue->entries[old_max + i] = queue->entries[i];
+		}
+	}
+
+	queue->entries[Q_INDEX(*queue, queue->num_entries)] = entry;
+	queue->num_entries++;
+	if (queue->num_entries > queue->peak_entries) {
+		queue->peak_entries = queue->num_entries;
+	}
+	return true;
+}
+
+
+/**
+Remove the first node in the queue.
+
+Returns false (leaving the entry untouched) if the queue is empty.
+**/
+bool lfr_pop_node_queue(lfr_node_queue_t *queue, lfr_queued_node_t *entry) {
+	assert(queue && entry);
+	if (!queue->num_entries) { return false; }
+
+	*entry = queue->entries[queue->head];
+	queue->head = Q_INDEX(*queue, 1);
+	queue->num_entries--;
+	queue->num_taken++;
+	return true;
+}
+
+
+/**
+Get the n:th node in queue (counting from the first) without removing it.
+**/
+lfr_queued_node_t lfr_peek_node_queue(unsigned n, const lfr_node_queue_t *queue) {
+	assert(queue && n < queue->num_entries);
+	return queue->entries[Q_INDEX(*queue, n)];
+}
+
+
+/**
+Release all memory held by the queue, leaving it empty.
+**/
+void lfr_term_node_queue(lfr_node_queue_t *queue) {
+	assert(queue);
+	free(queue->entries);
+	*queue = (lfr_node_queue_t) {0};
+}
+
+
+//// LFR Timer wheel ////
+
+// Lists in `first` after the slots
+enum {lfr_far_timers_ = lfr_wheel_levels * lfr_wheel_slots, lfr_free_timers_, lfr_no_timer_lists_};
+
+
+/**
+Terminate a timer wheel.
+
+Releases all memory owned by the wheel (sleeping nodes never wake up).
+**/
+void lfr_term_timer_wheel(lfr_timer_wheel_t *wheel) {
+	assert(wheel);
+	free(wheel->timers);
+	free(wheel->first);
+	*wheel = (lfr_timer_wheel_t) {0};
+}
+
+
+/*
+Put node to sleep until the clock of the state reaches the given time (it is then scheduled in the given lane).
+*/
+void lfr_sleep_node_(lfr_queued_node_t entry, unsigned lane, lfr_time_t wake_time, lfr_graph_state_t *state) {
+	lfr_timer_wheel_t *wheel = &state->sleeping_nodes;
+	if (!wheel->first) {
+		T_RESIZE_COLUMN(wheel->first, lfr_no_timer_lists_);
+		for (unsigned l = 0; l < lfr_no_timer_lists_; l++) { wheel->first[l] = UINT_MAX; }
+	}
+
+	// Idle wheels are left behind by the clock
+	if (!wheel->num_sleeping) { wheel->now = state->clock; }
+
+	// Reuse a free timer (or take a new one)
+	unsigned timer = wheel->first[lfr_free_timers_];
+	if (timer != UINT_MAX) {
+		wheel->first[lfr_free_timers_] = wheel->timers[timer].next;
+	} else {
+		if (wheel->num_timers == wheel->max_timers) {
+			wheel->max_timers = lfr_grow_capacity_(wheel->max_timers, wheel->num_timers + 1);
+			T_RESIZE_COLUMN(wheel->timers, wheel->max_timers);
+		}
+		timer = wheel->num_timers++;
+	}
+
+	wheel->timers[timer] = (lfr_timer_t) {entry, wake_time, UINT_MAX, lane};
+	wheel->num_sleeping++;
+	lfr_insert_timer_(timer, state);
+}
+
+
+/*
+Put timer in the slot where it belongs (at the current time of the wheel), or wake it up if it is due.
+*/
+void lfr_insert_timer_(unsigned timer, lfr_graph_state_t *state) {
+	lfr_timer_wheel_t *wheel = &state->sleeping_nodes;
+	lfr_timer_t *t = &wheel->timers[timer];
+
+	// Wake up (and free the timer)
+	if (t->wake_time <= wheel->now) {
+		lfr_push_node_queue_(t->entry, false, &state->schedueled_nodes[t->lane]);
+		t->next = wheel->first[lfr_free_timers_];
+		wheel->first[lfr_free_timers_] = timer;
+		wheel->num_sleeping--;
+		return;
+	}
+
+	// Lowest level where the wake time is in a later slot (the level of the highest bit that differs)
+	lfr_time_t differ = t->wake_time ^ wheel->now;
+	unsigned level = 0;
+	while (level < lfr_wheel_levels && (differ >> lfr_wheel_bits * (level + 1))) { level++; }
+
+	unsigned list = lfr_far_timers_;
+	if (level < lfr_wheel_levels) {
+		unsigned slot = (unsigned) (t->wake_time >> lfr_wheel_bits * level) % lfr_wheel_slots;
+		list = level * lfr_wheel_slots + slot;
+		wheel->occupied[level] |= 1ull << slot;
+	}
+	t->next = wheel->first[list];
+	wheel->first[list] = timer;
+}
+
+
+/*
+Start time of the first non-empty slot of the wheel (the far list when all levels are empty) and which list it is.
+
+Timers on lower levels always wake up before the ones on higher levels,
+so the first slot is on the lowest level with any timers.
+*/
+lfr_time_t lfr_next_timer_slot_(const lfr_timer_wheel_t *wheel, unsigned *list) {
+	for (unsigned level = 0; level < lfr_wheel_levels; level++) {
+		if (!wheel->occupied[level]) { continue; }
+
+		// Timers are always in later slots than the current time
+		unsigned shift = lfr_wheel_bits * level;
+		unsigned slot = (unsigned) (wheel->now >> shift) % lfr_wheel_slots;
+		while (!(wheel->occupied[level] >> slot & 1)) { slot++; }
+		assert(slot < lfr_wheel_slots);
+
+		*list = level * lfr_wheel_slots + slot;
+		lfr_time_t level_start = wheel->now >> (shift + lfr_wheel_bits) << (shift + lfr_wheel_bits);
+		return level_start + ((lfr_time_t) slot << shift);
+	}
+
+	// Far timers move down at the end of the top level
+	const unsigned top = lfr_wheel_bits * lfr_wheel_levels;
+	*list = lfr_far_timers_;
+	return ((wheel->now >> top) + 1) << top;
+}
+
+
+//// LFR Signal waits ////
+
+/**
+Terminate signal waits.
+
+Releases all memory (nodes waiting for signals are forgotten).
+**/
+void lfr_term_signal_waits(lfr_signal_waits_t *waits) {
+	assert(waits);
+	free(waits->waiters);
+	free(waits->last);
+	*waits = (lfr_signal_waits_t) {0};
+}
+
+
+/*
+Suspend node that went to sleep or started waiting for a signal (nothing happens for other results).
+*/
+void lfr_suspend_node_(lfr_result_e result, unsigned lane, const lfr_process_env_i *env, lfr_graph_state_t *state) {
+	lfr_queued_node_t later = {env->node_id, env->work};
+	if (result == lfr_sleep) {
+		lfr_sleep_node_(later, lane, env->wake_time, state);
+	} else if (result == lfr_await) {
+		lfr_await_signal_(later, lane, env->signal, state);
+	}
+}
+
+
+/*
+Make node wait until the given signal is raised (it is then scheduled in the given lane).
+
+Waiters of each signal form a circular list through the last one (so they wake up in order).
+*/
+void lfr_await_signal_(lfr_queued_node_t entry, unsigned lane, unsigned signal, lfr_graph_state_t *state) {
+	lfr_signal_waits_t *waits = &state->awaiting_nodes;
+	assert(signal < lfr_max_signals);
+	waits->last = lfr_grow_sparse_ids_(signal, waits->last, &waits->signal_range);
+
+	// Reuse a free waiter (or take a new one)
+	if (!waits->max_waiters) { waits->free_waiter = UINT_MAX; }
+	unsigned waiter = waits->free_waiter;
+	if (waiter != UINT_MAX) {
+		waits->free_waiter = waits->waiters[waiter].next;
+	} else {
+		if (waits->num_waiters == waits->max_waiters) {
+			waits->max_waiters = lfr_grow_capacity_(waits->max_waiters, waits->num_waiters + 1);
+			T_RESIZE_COLUMN(waits->waiters, waits->max_waiters);
+		}
+		waiter = waits->num_waiters++;
+	}
+
+	// Append to list of signal
+	unsigned last = waits->last[signal];
+	unsigned next = (last != UINT_MAX ? waits->waiters[last].next : waiter);
+	waits->waiters[waiter] = (lfr_signal_waiter_t) {entry, next, lane};
+	if (last != UINT_MAX) { waits->waiters[last].next = waiter; }
+	waits->last[signal] = waiter;
+	waits->num_waiting++;
+}
+
+
 /**
-Is the given id correspond to a row in the given node state table?
+Raise signal, scheduling all nodes waiting for it (in the order they started waiting).
+
+Nodes that start waiting for the signal after this wait for the next time it is raised.
+Returns the number of nodes woken up.
 **/
-bool lfr_node_state_table_contains(lfr_node_id_t id, const lfr_node_state_table_t *table) {
-	return T_HAS_ID(*table, id);
+unsigned lfr_raise_signal(unsigned signal, lfr_graph_state_t *state) {
+	assert(state && signal < lfr_max_signals);
+	lfr_signal_waits_t *waits = &state->awaiting_nodes;
+	if (signal >= waits->signal_range || waits->last[signal] == UINT_MAX) { return 0; }
+
+	// Take the whole list (so waiters added while waking up are left for next time)
+	unsigned last = waits->last[signal];
+	waits->last[signal] = UINT_MAX;
+
+	unsigned count = 0, waiter = waits->waiters[last].next;
+	for (;;) {
+		lfr_signal_waiter_t *w = &waits->waiters[waiter];
+		unsigned next = w->next;
+		lfr_push_node_queue_(w->entry, false, &state->schedueled_nodes[w->lane]);
+		w->next = waits->free_waiter;
+		waits->free_waiter = waiter;
+		count++;
+		if (waiter == last) { break; }
+		waiter = next;
+	}
+
+	waits->num_waiting -= count;
+	return count;
 }
 
 
 //// LFR Graph state ////
 
 
+/**
+Initialize an (empty) LFR graph state.
+
+A zeroed graph state is also a valid empty state.
+**/
+void lfr_init_graph_state(lfr_graph_state_t *state) {
+	assert(state);
+	*state = (lfr_graph_state_t) {0};
+}
+
+
+/**
+Terminate an LFR graph state.
+
+Releases all memory owned by the state.
+**/
+void lfr_term_graph_state(lfr_graph_state_t *state) {
+	assert(state);
+	for (unsigned lane = 0; lane < lfr_no_priorities; lane++) {
+		lfr_term_node_queue(&state->schedueled_nodes[lane]);
+	}
+	lfr_term_node_queue(&state->deferred_nodes);
+	lfr_term_timer_wheel(&state->sleeping_nodes);
+	lfr_term_signal_waits(&state->awaiting_nodes);
+	free(state->queued_marks);
+	lfr_term_node_state_table(&state->nodes);
+	free(state->program_values);
+	free(state->program_has_run);
+	*state = (lfr_graph_state_t) {0};
+}
+
+
+/**
+Decide what happens when (either) queue of the graph state reaches the given limit.
+
+A limit of zero means no limit (all policies then behave like `lfr_queue_grow`).
+Drop counters in each queue (`num_blocked`, `num_coalesced` and `num_dropped`)
+together with `peak_entries` can be used to find a good limit for production.
+**/
+void lfr_set_queue_policy(lfr_queue_policy_e policy, unsigned limit, lfr_graph_state_t *state) {
+	assert(state && policy < lfr_no_queue_policies);
+	for (unsigned lane = 0; lane < lfr_no_priorities; lane++) {
+		state->schedueled_nodes[lane].policy = policy;
+		state->schedueled_nodes[lane].limit = limit;
+	}
+	state->deferred_nodes.policy = policy;
+	state->deferred_nodes.limit = limit;
+}
+
+
+/**
+Coalesce requests for the same node (skip scheduling or deferring a node that is already waiting in that queue).
+
+Instructions of the given vm decide which nodes must still see every event (see `every_event`),
+pass NULL to stop coalescing. Flows continuing at a later point (like `repeat`) are never coalesced,
+skipped requests are counted in `num_coalesced` of the queue.
+Cuts down on redundant processing when many flows (or events) lead to the same node.
+**/
+void lfr_set_node_coalescing(const lfr_vm_t *vm, lfr_graph_state_t *state) {
+	assert(state);
+	state->coalescing = vm;
+}
+
+
+/**
+Process flow targets right away (instead of scheduling them) when the flow does not branch.
+
+At most `max_depth` nodes follow each other this way before falling back to the queues
+(zero always schedules them, which is the default). Linear chains then skip a queue round trip per node
+and get from trigger to effect in a single step (budgeted steps still check the budget before every node).
+Flows that branch, wait or sleep use the queues as usual. So do targets that would have to wait
+for nodes in higher lanes, and targets that are still queued when coalescing (see `lfr_set_node_coalescing()`).
+
+Note: Batched world stepping (see `lfr_step_world_batched()`) always schedules flow targets.
+**/
+void lfr_set_direct_flow(unsigned max_depth, lfr_graph_state_t *state) {
+	assert(state);
+	state->max_direct_depth = max_depth;
+}
+
+
+/**
+Number of nodes currently waiting in the *scheduled* queue (all lanes).
+**/
+unsigned lfr_count_scheduled_nodes(const lfr_graph_state_t *state) {
+	assert(state);
+	unsigned count = 0;
+	for (unsigned lane = 0; lane < lfr_no_priorities; lane++) {
+		count += state->schedueled_nodes[lane].num_entries;
+	}
+	return count;
+}
+
+
+/**
+Scheduled lane that the next node will be taken from (the highest one with any), NULL if nothing is scheduled.
+
+Read only, look at the next node with `lfr_peek_node_queue()`.
+**/
+const lfr_node_queue_t *lfr_peek_scheduled_nodes(const lfr_graph_state_t *state) {
+	assert(state);
+	for (unsigned lane = 0; lane < lfr_no_priorities; lane++) {
+		if (state->schedueled_nodes[lane].num_entries) { return &state->schedueled_nodes[lane]; }
+	}
+	return NULL;
+}
+
+
+/**
+Number of nodes currently waiting in the *deferred* queue.
+**/
+unsigned lfr_count_deferred_nodes(const lfr_graph_state_t *state) {
+	assert(state);
+	return state->deferred_nodes.num_entries;
+}
+
+
+/**
+Number of nodes currently sleeping (see `lfr_sleep`).
+**/
+unsigned lfr_count_sleeping_nodes(const lfr_graph_state_t *state) {
+	assert(state);
+	return state->sleeping_nodes.num_sleeping;
+}
+
+
+/**
+Number of nodes currently waiting for signals (see `lfr_await`).
+**/
+unsigned lfr_count_awaiting_nodes(const lfr_graph_state_t *state) {
+	assert(state);
+	return state->awaiting_nodes.num_waiting;
+}
+
+
 /**
 Get current value for the given node and *input* slot.
 **/
 lfr_variant_t lfr_get_input_value(lfr_node_id_t id, unsigned slot,
 		const lfr_vm_t *vm, const lfr_graph_t *graph, const lfr_graph_state_t *state) {
 	assert(graph && state);
-	assert(T_HAS_ID(graph->nodes, id));
-	assert(slot < lfr_signature_size);
+	assert(T_IS_LIVE(graph->nodes, id));
 
 	// Get data from linked output node slot if available
 	unsigned index = T_INDEX(graph->nodes, id);
-	const lfr_node_t *node = &graph->nodes.node[index];
-	lfr_node_id_t out_node = node->input_data[slot].node;
-	if (out_node.id) {
-		unsigned out_slot = node->input_data[slot].slot;
-		return lfr_get_output_value(out_node, out_slot, vm, graph, state);
+	if (graph->nodes.node[index].linked & (1u << slot)) {
+		lfr_slot_ref_t link = graph->nodes.slot[lfr_input_slot_(index, slot, &graph->nodes)].link;
+		return lfr_get_output_value(link.node, link.slot, vm, graph, state);
 	}
 
 	// Otherwise return fixed value from (imutable) graph
@@ -1620,13 +5150,23 @@ Get current value for the given node and *output* slot.
 lfr_variant_t lfr_get_output_value(lfr_node_id_t id, unsigned slot,
 		const lfr_vm_t *vm, const lfr_graph_t *graph, const lfr_graph_state_t *state) {
 	assert(graph && state);
-	assert(slot < lfr_signature_size);
+
+	// Return program data if the node is run by a program
+	const lfr_program_t *program = lfr_get_bound_program_(state);
+	if (program) {
+		unsigned op = lfr_find_program_op_(id, program);
+		if (op != UINT_MAX) {
+			assert(slot < program->ops[op].num_outputs);
+			return state->program_values[program->ops[op].output + slot];
+		}
+	}
 
 	// Return state data if available
-	if (lfr_node_state_table_contains(id, &state->nodes)) {
-		unsigned index = T_INDEX(state->nodes, id);
-		const lfr_node_state_t *node_state = &state->nodes.node_state[index];
-		return node_state->output_data[slot];
+	unsigned row = lfr_find_node_state_(id, &graph->nodes, &state->nodes);
+	if (row != UINT_MAX) {
+		const lfr_node_state_t *node_state = &state->nodes.node_state[row];
+		assert(slot < node_state->num_outputs);
+		return state->nodes.value[node_state->first_value + slot];
 	}
 
 	// Otherwise return default
@@ -1637,12 +5177,64 @@ lfr_variant_t lfr_get_output_value(lfr_node_id_t id, unsigned slot,
 /**
 Forward the current time of graph state by the diven amount.
 
+Sleeping nodes that are due wake up (they are scheduled).
+
 Intenals:
 Used by the `delay` core instruction.
 **/
 void lfr_forward_state_time(float dt, lfr_graph_state_t *state) {
 	assert(state);
-	state->time += dt;
+	lfr_forward_state_clock(lfr_seconds_to_clock_(dt), state);
+}
+
+
+/**
+Same as `lfr_forward_state_time()`, but in microseconds.
+**/
+void lfr_forward_state_clock(lfr_time_t dt, lfr_graph_state_t *state) {
+	assert(state);
+	lfr_set_state_clock_(state->clock + dt, state);
+}
+
+
+/*
+Set the clock of the state (and the time in seconds), waking up sleeping nodes that are due.
+*/
+void lfr_set_state_clock_(lfr_time_t clock, lfr_graph_state_t *state) {
+	state->clock = clock;
+	state->time = lfr_clock_to_seconds_(clock);
+
+	lfr_timer_wheel_t *wheel = &state->sleeping_nodes;
+	while (wheel->num_sleeping) {
+		// Empty the first slot once reached (its timers wake up or move down a level)
+		unsigned list;
+		lfr_time_t start = lfr_next_timer_slot_(wheel, &list);
+		if (start > clock) { break; }
+		if (start > wheel->now) { wheel->now = start; }
+		if (list < lfr_wheel_levels * lfr_wheel_slots) {
+			wheel->occupied[list / lfr_wheel_slots] &= ~(1ull << list % lfr_wheel_slots);
+		}
+		unsigned timer = wheel->first[list];
+		wheel->first[list] = UINT_MAX;
+		while (timer != UINT_MAX) {
+			unsigned next = wheel->timers[timer].next;
+			lfr_insert_timer_(timer, state);
+			timer = next;
+		}
+	}
+	if (wheel->now < clock) { wheel->now = clock; }
+}
+
+
+/* Seconds as clock time (rounded to closest microsecond, nothing if negative). */
+lfr_time_t lfr_seconds_to_clock_(float seconds) {
+	return (seconds > 0 ? (lfr_time_t) (seconds * 1000000.0 + 0.5) : 0);
+}
+
+
+/* Clock time in seconds. */
+float lfr_clock_to_seconds_(lfr_time_t clock) {
+	return (float) (clock / 1000000.0);
 }
 
 
@@ -1652,12 +5244,12 @@ void lfr_forward_state_time(float dt, lfr_graph_state_t *state) {
 Convert all variant types to a float.
 **/
 float lfr_to_float(lfr_variant_t var) {
-	switch(var.type) {
+	switch(lfr_get_variant_type(var)) {
 	case lfr_nil_type: return 0;
 	case lfr_bool_type: return (var.bool_value ? 1.f : 0.f);
 	case lfr_int_type: return (float) var.int_value;
 	case lfr_float_type: return var.float_value;
-	case lfr_vec2_type: return var.vec2_value.x;
+	case lfr_vec2_type: return lfr_to_vec2(var).x;
 	case lfr_no_core_types: assert(0); return 0;
 	}
 }
@@ -1667,12 +5259,12 @@ float lfr_to_float(lfr_variant_t var) {
 Convert all variant types to an int.
 **/
 int lfr_to_int(lfr_variant_t var) {
-	switch(var.type) {
+	switch(lfr_get_variant_type(var)) {
 	case lfr_nil_type: return 0;
 	case lfr_bool_type: return (var.bool_value ? 1 : 0);
 	case lfr_int_type: return var.int_value;
 	case lfr_float_type: return (int) var.float_value;
-	case lfr_vec2_type: return (int) var.vec2_value.x;
+	case lfr_vec2_type: return (int) lfr_to_vec2(var).x;
 	case lfr_no_core_types: assert(0); return 0;
 	}
 }
@@ -1686,10 +5278,29 @@ bool lfr_to_bool(lfr_variant_t var) {
 }
 
 
+/**
+Convert all variant types to a vec2 (other types than vec2 end up on the x axis).
+**/
+lfr_vec2_t lfr_to_vec2(lfr_variant_t var) {
+	if (lfr_get_variant_type(var) != lfr_vec2_type) {
+		return (lfr_vec2_t) { lfr_to_float(var), 0 };
+	}
+#ifndef LFR_COMPACT_VARIANTS
+	return var.vec2_value;
+#else
+	return (lfr_vec2_t) { var.float_value, lfr_bits_float_(~var.box) };
+#endif
+}
+
+
 #undef T_HAS_ID
+#undef T_IS_LIVE
 #undef T_INDEX
 #undef T_ID
 #undef T_FOR_ROWS
+#undef T_RESIZE_COLUMN
+#undef Q_INDEX
+#undef LFR_X86_SIMD_
 #undef LFR_TRACE
 #endif
 
@@ -32,18 +32,25 @@ typedef struct lfr_editor_ {
 
 	// Layout
 	struct nk_rect outer_bounds;
-	float node_heights[lfr_node_table_max_rows];
-	struct {
+
+	// Layout (one row per flow link)
+	unsigned max_flow_links;
+	struct lfr_editor_flow_link_points_ {
 		lfr_vec2_t source, target;
-	} flow_link_points[lfr_graph_max_flow_links];
-	struct {
+	} *flow_link_points;
+
+	// Layout (one row per node table row)
+	unsigned max_node_rows;
+	float *node_heights;
+	struct lfr_editor_data_link_points_ {
 		lfr_vec2_t inputs[lfr_signature_size], outputs[lfr_signature_size];
-	} data_link_points[lfr_node_table_max_rows];
+	} *data_link_points;
 } lfr_editor_t;
 
 
 // Editor
 void lfr_init_editor(struct nk_rect bounds, struct nk_context*, lfr_editor_t*);
+void lfr_term_editor(lfr_editor_t*);
 void lfr_show_editor(lfr_editor_t * app, const lfr_vm_t*, lfr_graph_t *, lfr_graph_state_t *);
 void lfr_show_debug(struct nk_context*, lfr_graph_t *, lfr_graph_state_t *);
 
@@ -60,12 +67,20 @@ void show_node_input_slots_group(lfr_node_id_t,
 void show_node_output_slots_group(lfr_node_id_t,
 	const lfr_vm_t *, const lfr_graph_state_t*, lfr_graph_t*, lfr_editor_t*);
 
+// Layout memory
+void reserve_editor_node_rows(unsigned, lfr_editor_t *);
+void reserve_editor_flow_links(unsigned, lfr_editor_t *);
+
 // Lines between nodes
 void draw_flow_link_lines(const lfr_editor_t *, const lfr_graph_t *, struct nk_command_buffer *);
 void draw_data_link_lines(const lfr_editor_t *, const lfr_graph_t *, struct nk_command_buffer *);
 void draw_link_selection_curve(const lfr_editor_t *, const lfr_graph_t *, struct nk_command_buffer *);
 void show_node_creation_contextual_menu(const lfr_vm_t *, struct nk_context *, lfr_graph_t *);
 
+// Debugging
+int debug_node_index(lfr_node_id_t, const lfr_graph_t *);
+void show_debug_queue_label(struct nk_context *, const char *, const lfr_node_queue_t *);
+
 // Understand Nuklear better
 void show_window_internals_section(struct nk_context *);
 
@@ -81,12 +96,74 @@ void lfr_init_editor(struct nk_rect bounds, struct nk_context *ctx, lfr_editor_t
 }
 
 
+/**
+Terminate editor, releasing layout memory.
+**/
+void lfr_term_editor(lfr_editor_t *editor) {
+	assert(editor);
+	free(editor->node_heights);
+	free(editor->data_link_points);
+	free(editor->flow_link_points);
+	editor->node_heights = NULL;
+	editor->data_link_points = NULL;
+	editor->flow_link_points = NULL;
+	editor->max_node_rows = editor->max_flow_links = 0;
+}
+
+
+/*
+Make sure there is layout data for (at least) the given number of node rows.
+*/
+void reserve_editor_node_rows(unsigned num_rows, lfr_editor_t *editor) {
+	assert(editor);
+	if (num_rows <= editor->max_node_rows) { return; }
+
+	editor->node_heights = realloc(editor->node_heights, sizeof(float) * num_rows);
+	editor->data_link_points = realloc(editor->data_link_points,
+		sizeof(struct lfr_editor_data_link_points_) * num_rows);
+	assert(editor->node_heights && editor->data_link_points);
+
+	// Clear new rows
+	for (unsigned i = editor->max_node_rows; i < num_rows; i++) {
+		editor->node_heights[i] = 0;
+		editor->data_link_points[i] = (struct lfr_editor_data_link_points_) {0};
+	}
+	editor->max_node_rows = num_rows;
+}
+
+
+/*
+Make sure there is layout data for (at least) the given number of flow links.
+*/
+void reserve_editor_flow_links(unsigned num_links, lfr_editor_t *editor) {
+	assert(editor);
+	if (num_links <= editor->max_flow_links) { return; }
+
+	editor->flow_link_points = realloc(editor->flow_link_points,
+		sizeof(struct lfr_editor_flow_link_points_) * num_links);
+	assert(editor->flow_link_points);
+
+	// Clear new rows
+	for (unsigned i = editor->max_flow_links; i < num_links; i++) {
+		editor->flow_link_points[i] = (struct lfr_editor_flow_link_points_) {0};
+	}
+	editor->max_flow_links = num_links;
+}
+
+
 /**
 Show a script graph using Nuclear widgets.
 **/
 void lfr_show_editor(lfr_editor_t *app, const lfr_vm_t *vm, lfr_graph_t *graph, lfr_graph_state_t* state) {
 	assert(app && graph && state);
 	struct nk_context *ctx = app->ctx;
+	reserve_editor_node_rows(graph->nodes.max_rows, app);
+	reserve_editor_flow_links(graph->max_flow_links, app);
+
+	// Leave linking modes if the active node has been removed
+	if (app->mode != em_normal && !lfr_node_table_contains(app->active_node_id, &graph->nodes)) {
+		app->mode = em_normal;
+	}
 
 	nk_flags window_flags = 0
 		| NK_WINDOW_TITLE
@@ -155,7 +232,7 @@ void lfr_show_editor(lfr_editor_t *app, const lfr_vm_t *vm, lfr_graph_t *graph,
 
 	// Remove node that has recently had it's window closed
 	// (Avoid pain by waitning until after cycling through nodes before removing one)
-	if (app->removal_of_node_requested.id) {
+	if (lfr_node_table_contains(app->removal_of_node_requested, &graph->nodes)) {
 		lfr_remove_node(app->removal_of_node_requested, graph);
 		app->removal_of_node_requested = (lfr_node_id_t) {0};
 		app->skip_drawin_lines = 2;
@@ -234,8 +311,9 @@ void show_individual_node_window(
 	char title[1024];
 	lfr_instruction_e inst = graph->nodes.node[node_index].instruction;
 	const char* inst_name = lfr_get_instruction_name(inst, vm);
-	bool next_scheduled = (state->num_schedueled_nodes && node_id.id ==  state->schedueled_nodes[0].id);
-	bool next_deferred = (state->num_deferred_nodes && node_id.id ==  state->deferred_nodes[0].node.id);
+	const lfr_node_queue_t *sq = lfr_peek_scheduled_nodes(state), *dq = &state->deferred_nodes;
+	bool next_scheduled = (sq && node_id.id == lfr_peek_node_queue(0, sq).node.id);
+	bool next_deferred = (dq->num_entries && node_id.id == lfr_peek_node_queue(0, dq).node.id);
 	snprintf(title, 1024, "[#%u|%u] %s%s%s"
 		, node_id.id, node_index, inst_name
 		, next_scheduled ? " (next scheduled)" : ""
@@ -324,6 +402,7 @@ void show_individual_node_window(
 				if (nk_button_label(ctx, "Link with this!")){
 					// Link
 					lfr_link_nodes(source_id, target_id, graph);
+					reserve_editor_flow_links(graph->max_flow_links, app);
 
 					// Clear
 					app->mode = em_normal;
@@ -460,7 +539,7 @@ void show_node_input_slots_group(
 	lfr_node_t *node = &graph->nodes.node[node_index];
 
 	// Go over all (real) input slots
-	for (int slot = 0; slot < lfr_signature_size; slot++) {
+	for (int slot = 0; slot < node->num_inputs; slot++) {
 		const char* name = lfr_get_instruction(node->instruction, vm)->input_signature[slot].name;
 		if (!name) { continue; };
 
@@ -481,7 +560,7 @@ void show_node_input_slots_group(
 				// Clear editor mode
 				app->mode = em_normal;
 			}
-		} else if (node->input_data[slot].node.id == 0) {
+		} else if (lfr_get_data_link(node_id, slot, graph).node.id == 0) {
 			// Enter data linking mode on button press
 			if (nk_button_label(ctx, "+")) {
 				app->mode = em_select_data_link_output;
@@ -509,9 +588,9 @@ void show_node_input_slots_group(
 		// Current input value (linked or fixed)
 		// (Set a new value if it's changed by the UI, and breaks any link))
 		const lfr_variant_t data = lfr_get_input_value(node_id, slot, vm, graph, state);
-		int num_cols = (data.type == lfr_vec2_type ? 2 : 1);
+		int num_cols = (lfr_get_variant_type(data) == lfr_vec2_type ? 2 : 1);
 		nk_layout_row_dynamic(ctx, LFR_SLOT_VALUE_ROW_H, num_cols);
-		switch(data.type) {
+		switch(lfr_get_variant_type(data)) {
 		case lfr_nil_type: {
 			nk_label(ctx, "---", NK_TEXT_RIGHT);
 		} break;
@@ -536,9 +615,10 @@ void show_node_input_slots_group(
 		} break;
 		case lfr_vec2_type: {
 			// Set a new value if it's changed by the UI (breaks link)
-			float new_x = nk_propertyf(ctx, "#x =", -FLT_MAX, data.vec2_value.x, +FLT_MAX, 1, 1);
-			float new_y = nk_propertyf(ctx, "#y =", -FLT_MAX, data.vec2_value.y, +FLT_MAX, 1, 1);
-			if (data.vec2_value.x != new_x || data.vec2_value.y != new_y) {
+			lfr_vec2_t vec2 = lfr_to_vec2(data);
+			float new_x = nk_propertyf(ctx, "#x =", -FLT_MAX, vec2.x, +FLT_MAX, 1, 1);
+			float new_y = nk_propertyf(ctx, "#y =", -FLT_MAX, vec2.y, +FLT_MAX, 1, 1);
+			if (vec2.x != new_x || vec2.y != new_y) {
 				lfr_set_fixed_input_value(node_id, slot, lfr_vec2_xy(new_x, new_y), &graph->nodes);
 			}
 		} break;
@@ -573,7 +653,7 @@ void show_node_output_slots_group(
 	lfr_instruction_e inst = graph->nodes.node[node_index].instruction;
 
 	// Go over all (real) output slots
-	for (int slot = 0; slot < lfr_signature_size; slot++) {
+	for (int slot = 0; slot < graph->nodes.node[node_index].num_outputs; slot++) {
 		const char* name = lfr_get_instruction(inst, vm)->output_signature[slot].name;
 		lfr_variant_t data = lfr_get_output_value(node_id, slot, vm, graph, state);
 		if (!name) { continue; }
@@ -625,7 +705,7 @@ void show_node_output_slots_group(
 		// Value
 		nk_layout_row_dynamic(ctx, LFR_SLOT_VALUE_ROW_H, 1);
 		char label_buf[32];
-		switch (data.type) {
+		switch (lfr_get_variant_type(data)) {
 		case lfr_nil_type: {
 			snprintf(label_buf, 32, "---");
 		} break;
@@ -636,7 +716,7 @@ void show_node_output_slots_group(
 			snprintf(label_buf, 32, "%d", data.int_value);
 		} break;
 		case lfr_vec2_type: {
-			snprintf(label_buf, 32, "%.1f,%.1f", data.vec2_value.x, data.vec2_value.y);
+			snprintf(label_buf, 32, "%.1f,%.1f", lfr_to_vec2(data).x, lfr_to_vec2(data).y);
 		} break;
 		case lfr_float_type: {
 			snprintf(label_buf, 32, "(%.3f)", data.float_value);
@@ -691,8 +771,9 @@ void draw_data_link_lines(const lfr_editor_t *app, const lfr_graph_t *graph, str
 		const lfr_vec2_t node_win_pos = lfr_get_node_position(in_node_id, &graph->nodes);
 
 		// For every linked pair of slots
-		for (int slot = 0; slot < lfr_signature_size; slot++) {
-			lfr_node_id_t out_node_id = node->input_data[slot].node;
+		for (int slot = 0; slot < node->num_inputs; slot++) {
+			lfr_slot_ref_t link = lfr_get_data_link(in_node_id, slot, graph);
+			lfr_node_id_t out_node_id = link.node;
 			if (!out_node_id.id) { continue; }
 
 			// Input slot height (on this node)
@@ -700,7 +781,7 @@ void draw_data_link_lines(const lfr_editor_t *app, const lfr_graph_t *graph, str
 
 			// Output slot position (on other node)
 			unsigned output_index = lfr_get_node_index(out_node_id, &graph->nodes);
-			unsigned output_slot = node->input_data[slot].slot;
+			unsigned output_slot = link.slot;
 			lfr_vec2_t out_pos = app->data_link_points[output_index].outputs[output_slot];
 
 			// Draw curve
@@ -729,7 +810,7 @@ void draw_link_selection_curve(
 	struct nk_vec2 mouse_pos = app->ctx->input.mouse.pos;
 
 	// Select source node in flow
-	if (app->mode == em_select_flow_prev && app->active_node_id.id) {
+	if (app->mode == em_select_flow_prev && lfr_node_table_contains(app->active_node_id, &graph->nodes)) {
 		// Connected end
 		lfr_vec2_t target_p = lfr_get_node_position(app->active_node_id, &graph->nodes);
 		target_p.y += 20;
@@ -739,7 +820,7 @@ void draw_link_selection_curve(
 	}
 
 	// Select target node in flow
-	if (app->mode == em_select_flow_next && app->active_node_id.id) {
+	if (app->mode == em_select_flow_next && lfr_node_table_contains(app->active_node_id, &graph->nodes)) {
 		// Connected end
 		lfr_vec2_t source_p = lfr_get_node_position(app->active_node_id, &graph->nodes);
 		source_p.x += node_window_w;
@@ -793,7 +874,7 @@ void show_node_creation_contextual_menu(const lfr_vm_t *vm, struct nk_context* c
 		const char* name = lfr_get_custom_instruction_name(i, vm);
 		if ( nk_contextual_item_label(ctx, name, NK_TEXT_LEFT)) {
 			// Create node at context menu origin
-			lfr_node_id_t id = lfr_add_custom_node(i, graph);
+			lfr_node_id_t id = lfr_add_custom_node(i, vm, graph);
 			lfr_set_node_position(id, creation_pos, &graph->nodes);
 		}
 	}
@@ -802,6 +883,26 @@ void show_node_creation_contextual_menu(const lfr_vm_t *vm, struct nk_context* c
 }
 
 
+/*
+Get node index for display purposes (-1 if the node is no longer in the graph).
+*/
+int debug_node_index(lfr_node_id_t node_id, const lfr_graph_t *graph) {
+	if (!lfr_node_table_contains(node_id, &graph->nodes)) { return -1; }
+	return (int) lfr_get_node_index(node_id, &graph->nodes);
+}
+
+
+/*
+Show queue name together with queue statistics (peak size and lost entries).
+*/
+void show_debug_queue_label(struct nk_context *ctx, const char *name, const lfr_node_queue_t *queue) {
+	unsigned lost = queue->num_blocked + queue->num_coalesced + queue->num_dropped;
+	char label[128];
+	snprintf(label, 128, "%s (peak %u, lost %u)", name, queue->peak_entries, lost);
+	nk_label(ctx, label, NK_TEXT_LEFT);
+}
+
+
 /**
 Show various debugging information for the given graph and state.
 **/
@@ -816,28 +917,44 @@ void lfr_show_debug(struct nk_context *ctx, lfr_graph_t *graph, lfr_graph_state_
 	if (nk_begin(ctx, "Queued nodes", nk_rect(500,500, 300, 200), window_flags)) {
 		nk_layout_row_dynamic(ctx, 0, 1);
 
-		nk_property_float(ctx, "Time", 0, &state->time, FLT_MAX, 1,1);
-
-		// Scheduled first
-		nk_label(ctx, "Scheduled", NK_TEXT_LEFT);
-		for (int i = 0 ; i < state->num_schedueled_nodes; i++) {
-			lfr_node_id_t node_id = state->schedueled_nodes[i];
-			unsigned index = graph->nodes.sparse_id[node_id.id];
-			char label[1024];
-			snprintf(label, 1024, "Node [#%u|%u]", node_id.id, index);
-			nk_label(ctx, label, NK_TEXT_RIGHT);
+		// Time only goes forward (sleeping nodes wake up on the way)
+		float time = state->time;
+		nk_property_float(ctx, "Time", state->time, &time, FLT_MAX, 1,1);
+		if (time > state->time) { lfr_forward_state_time(time - state->time, state); }
+
+		// Scheduled first (one lane at the time)
+		for (unsigned lane = 0; lane < lfr_no_priorities; lane++) {
+			const lfr_node_queue_t *queue = &state->schedueled_nodes[lane];
+			char name[64];
+			snprintf(name, 64, "Scheduled (%s)", lfr_get_priority_name(lane));
+			show_debug_queue_label(ctx, name, queue);
+			for (int i = 0 ; i < queue->num_entries; i++) {
+				lfr_node_id_t node_id = lfr_peek_node_queue(i, queue).node;
+				int index = debug_node_index(node_id, graph);
+				char label[1024];
+				snprintf(label, 1024, "Node [#%u|%d]", node_id.id, index);
+				nk_label(ctx, label, NK_TEXT_RIGHT);
+			}
 		}
 
 		// Then defered
-		nk_label(ctx, "Defered", NK_TEXT_LEFT);
-		for (int i = 0 ; i < state->num_deferred_nodes; i++) {
-			lfr_node_id_t node_id = state->deferred_nodes[i].node;
-			unsigned work = state->deferred_nodes[i].work;
-			unsigned index = graph->nodes.sparse_id[node_id.id];
+		show_debug_queue_label(ctx, "Defered", &state->deferred_nodes);
+		for (int i = 0 ; i < lfr_count_deferred_nodes(state); i++) {
+			lfr_queued_node_t entry = lfr_peek_node_queue(i, &state->deferred_nodes);
+			lfr_node_id_t node_id = entry.node;
+			unsigned work = entry.work;
+			int index = debug_node_index(node_id, graph);
 			char label[1024];
-			snprintf(label, 1024, "Node [#%u|%u] (%u)", node_id.id, index, work);
+			snprintf(label, 1024, "Node [#%u|%d] (%u)", node_id.id, index, work);
 			nk_label(ctx, label, NK_TEXT_RIGHT);
 		}
+
+		// Suspended last (only how many)
+		char label[128];
+		snprintf(label, 128, "Sleeping (%u)", lfr_count_sleeping_nodes(state));
+		nk_label(ctx, label, NK_TEXT_LEFT);
+		snprintf(label, 128, "Awaiting signals (%u)", lfr_count_awaiting_nodes(state));
+		nk_label(ctx, label, NK_TEXT_LEFT);
 	}
 	nk_end(ctx);
 }